@@ -57,8 +57,8 @@ multi_rate_unif_bins base dist n_bins = multi_rate base $ uniformDiscretize dist
 rate (ReversibleMarkov a s q pi l t r) = r;
 rate (MixtureModel d) = average (fmap2 rate d);
 
-branchTransitionP (MixtureModel l) t = let {r = rate (MixtureModel l)} 
-                                                              in map (\x -> qExp (scale (t/r) (snd x))) l;
+branchTransitionPs (MixtureModel l) t = let {r = rate (MixtureModel l)}
+                                        in qExps (map (\x -> scale (t/r) (snd x)) l);
 
 -- In theory we could take just (a,q) since we could compute smap from a (if states are simple) and pi from q.
 nBaseModels (MixtureModel l) = length l;
@@ -310,7 +310,7 @@ log_normal_rates base sigmaOverMu n = multi_rate_unif_bins base (log_normal_rate
 --dp base rates fraction = multi_rate base dist where {dist = zip fraction rates};
 free_rates base rates fraction = scaled_mixture (replicate (length fraction) base) rates fraction;
 
-branch_transition_p t smodel branch_cat_list ds b = list_to_vector $ branchTransitionP (getNthMixture smodel (branch_cat_list!!b)) (ds!b);
+branch_transition_p t smodel branch_cat_list ds b = branchTransitionPs (getNthMixture smodel (branch_cat_list!!b)) (ds!b);
 
 transition_p_index t smodel branch_cat_list ds = mkArray (numBranches t) (branch_transition_p t smodel branch_cat_list ds);
 
@@ -7,11 +7,19 @@ builtin get_equilibrium_rate 4 "get_equilibrium_rate" "SModel";
 builtin get_eigensystem 2 "get_eigensystem" "SModel";
 builtin reversible_rate_matrix 2 "reversible_rate_matrix" "SModel";
 builtin lExp 3 "lExp" "SModel";
+builtin lExps 3 "lExps" "SModel";
 
 data ReversibleMarkov = ReversibleMarkov a b c d e f g;
 
 qExp (ReversibleMarkov a s q pi l t r) = lExp l pi t;
 
+eigensystem (ReversibleMarkov a s q pi l t r) = l;
+time_scale (ReversibleMarkov a s q pi l t r) = t;
+equilibrium (ReversibleMarkov a s q pi l t r) = pi;
+
+-- Exponentiate several models at once, so that models with the same eigensystem (e.g. rate categories) share the work.
+qExps ms = lExps (list_to_vector (map eigensystem ms)) (list_to_vector (map equilibrium ms)) (list_to_vector (map time_scale ms));
+
 scale x (ReversibleMarkov a s q pi l t r) = ReversibleMarkov a s q pi l (x*t) (x*r);
 
 -- In theory we could take just (a,q) since we could compute smap from a (if states are simple) and pi from q.
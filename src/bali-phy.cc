@@ -41,6 +41,9 @@ namespace mpi = boost::mpi;
 #include <sstream>
 #include <new>
 #include <map>
+#include <set>
+#include <mutex>
+#include <exception>
 
 #include <boost/program_options.hpp>
 #include <boost/filesystem/operations.hpp>
@@ -70,6 +73,10 @@ namespace mpi = boost::mpi;
 #include "startup/io.H"
 #include "startup/system.H"
 #include "startup/cmd_line.H"
+#include "util/thread-pool.H"
+#include "util/buffer-pool.H"
+#include "math/eigenvalue.H"
+#include "math/exponential.H"
 #include "computation/expression/expression.H"
 #include "computation/loader.H"
 
@@ -177,48 +184,91 @@ string ctime(const chrono::system_clock::time_point& t)
     return c;
 }
 
+// Statistics counters for the abstract machine.  Each thread has its own copy.
+extern thread_local long total_reductions;
+extern thread_local long total_changeable_eval;
+extern thread_local long total_changeable_eval_with_result;
+extern thread_local long total_changeable_eval_with_call;
+extern thread_local long total_changeable_reductions;
+extern thread_local long total_reg_allocations;
+extern thread_local long total_comp_allocations;
+extern thread_local long total_step_allocations;
+extern thread_local long total_destroy_token;
+extern thread_local long total_release_knuckle;
+extern thread_local long total_create_context1;
+extern thread_local long total_create_context2;
+extern thread_local long total_tokens;
+extern thread_local long max_version;
+extern thread_local long total_reroot;
+extern thread_local long total_reroot_one;
+extern thread_local long total_set_reg_value;
+extern thread_local long total_get_reg_value;
+extern thread_local long total_get_reg_value_non_const;
+extern thread_local long total_get_reg_value_non_const_with_result;
+extern thread_local long total_invalidate;
+extern thread_local long total_steps_invalidated;
+extern thread_local long total_results_invalidated;
+extern thread_local long total_steps_scanned;
+extern thread_local long total_results_scanned;
+extern thread_local long total_steps_pivoted;
+extern thread_local long total_results_pivoted;
+extern thread_local long total_context_pr;
+extern thread_local long total_gc;
+extern thread_local long total_young_gc;
+extern thread_local long total_regs;
+extern thread_local long total_steps;
+extern thread_local long total_comps;
+extern thread_local long total_case_op;
+extern thread_local long total_let_op;
+extern thread_local long total_index_op;
+
+/// This thread's copies of the machine statistics counters that are added up over chains.
+///
+/// total_tokens and max_version are maxima, so they are combined separately.
+vector<long*> thread_machine_counters()
+{
+    return {&total_reductions,
+	    &total_changeable_eval,
+	    &total_changeable_eval_with_result,
+	    &total_changeable_eval_with_call,
+	    &total_changeable_reductions,
+	    &total_reg_allocations,
+	    &total_comp_allocations,
+	    &total_step_allocations,
+	    &total_destroy_token,
+	    &total_release_knuckle,
+	    &total_create_context1,
+	    &total_create_context2,
+	    &total_reroot,
+	    &total_reroot_one,
+	    &total_set_reg_value,
+	    &total_get_reg_value,
+	    &total_get_reg_value_non_const,
+	    &total_get_reg_value_non_const_with_result,
+	    &total_invalidate,
+	    &total_steps_invalidated,
+	    &total_results_invalidated,
+	    &total_steps_scanned,
+	    &total_results_scanned,
+	    &total_steps_pivoted,
+	    &total_results_pivoted,
+	    &total_context_pr,
+	    &total_gc,
+	    &total_young_gc,
+	    &total_regs,
+	    &total_steps,
+	    &total_comps,
+	    &total_case_op,
+	    &total_let_op,
+	    &total_index_op};
+}
+
 void show_ending_messages(bool show_only)
 {
     using namespace chrono;
 
     if (not show_only or log_verbose >= 2) {
 
-	extern long total_reductions;
-	extern long total_changeable_eval;
-	extern long total_changeable_eval_with_result;
-	extern long total_changeable_eval_with_call;
-	extern long total_changeable_reductions;
-	extern long total_reg_allocations;
-	extern long total_comp_allocations;
-	extern long total_step_allocations;
-	extern long total_destroy_token;
-	extern long total_release_knuckle;
-	extern long total_create_context1;
-	extern long total_create_context2;
-	extern long total_tokens;
-	extern long max_version;
-	extern long total_reroot;
-	extern long total_reroot_one;
-	extern long total_set_reg_value;
-	extern long total_get_reg_value;
-	extern long total_get_reg_value_non_const;
-	extern long total_get_reg_value_non_const_with_result;
-	extern long total_invalidate;
-	extern long total_steps_invalidated;
-	extern long total_results_invalidated;
-	extern long total_steps_scanned;
-	extern long total_results_scanned;
-	extern long total_steps_pivoted;
-	extern long total_results_pivoted;
-	extern long total_context_pr;
-	extern long total_gc;
-	extern long total_regs;
-	extern long total_steps;
-	extern long total_comps;
-
-	extern long total_case_op;
-	extern long total_let_op;
-	extern long total_index_op;
 	if (total_reductions > 0)
 	{
 	    cout<<"total changeable evals         = "<<total_changeable_eval<<endl;
@@ -231,6 +281,7 @@ void show_ending_messages(bool show_only)
 	    cout<<"  op:let                       = "<<total_let_op<<endl;
 	    cout<<"  op:index                     = "<<total_index_op<<endl;
 	    cout<<"\ntotal garbage collection runs  = "<<total_gc<<endl;
+	    cout<<"total young collection runs    = "<<total_young_gc<<endl;
 	    cout<<"total register allocations     = "<<total_reg_allocations<<endl;
 	    cout<<"total computation allocations  = "<<total_comp_allocations<<endl;
 	    cout<<"total step allocations         = "<<total_step_allocations<<endl;
@@ -276,6 +327,11 @@ void show_ending_messages(bool show_only)
 	cout<<"total calc_root_prob evals = "<<substitution::total_calc_root_prob<<endl;
 	cout<<"total branches peeled = "<<substitution::total_peel_leaf_branches+substitution::total_peel_internal_branches<<endl;
 	cout<<"average root clv length = "<<substitution::total_root_clv_length/substitution::total_calc_root_prob<<endl;
+	cout<<"likelihood cache buffers = "<<likelihood_buffer_pool().stats()<<endl;
+	if (substitution::total_precision_checks > 0)
+	    cout<<"single precision: max log-likelihood error = "<<substitution::max_precision_error<<" in "<<substitution::total_precision_checks<<" checks"<<endl;
+	if (substitution::total_double_columns > 0)
+	    cout<<"single precision: "<<substitution::total_double_columns<<" columns recomputed in double precision"<<endl;
 	cout<<endl;
     }
 }
@@ -317,9 +373,227 @@ std::shared_ptr<module_loader> setup_module_loader(variables_map& args, const st
 	throw myexception()<<"Can't find Prelude in module path.  Use --package-path=<path> to specify the directory containing 'modules/Prelude.hs'.";
     }
 
+    // 6. Set the simplifier options
+    L.pre_inline_unconditionally = args["pre-inline"].as<bool>();
+    L.post_inline_unconditionally = args["post-inline"].as<bool>();
+    L.let_float_from_case = args["let-float-from-case"].as<bool>();
+    L.let_float_from_apply = args["let-float-from-apply"].as<bool>();
+    L.let_float_from_let = args["let-float-from-let"].as<bool>();
+    L.case_of_constant = args["case-of-constant"].as<bool>();
+    L.case_of_variable = args["case-of-variable"].as<bool>();
+    L.case_of_case = args["case-of-case"].as<bool>();
+    L.inline_threshhold = args["inline-threshold"].as<int>();
+    L.keenness = args["keenness"].as<double>();
+    L.beta_reduction = args["beta-reduction"].as<bool>();
+    L.max_iterations = args["simplifier-max-iterations"].as<int>();
+
+    // 7. Reuse modules compiled by earlier runs of the same executable with the same simplifier options.
+    if (args.count("module-cache"))
+    {
+	fs::path exe = find_exe_path(argv0) / fs::path(argv0).filename();
+	if (fs::exists(exe))
+	{
+	    std::ostringstream compiler_id;
+	    compiler_id<<executable_id(exe)<<" "
+		       <<L.pre_inline_unconditionally<<L.post_inline_unconditionally
+		       <<L.let_float_from_case<<L.let_float_from_apply<<L.let_float_from_let
+		       <<L.case_of_constant<<L.case_of_variable<<L.case_of_case<<L.beta_reduction<<" "
+		       <<L.inline_threshhold<<" "<<L.keenness<<" "<<L.max_iterations;
+	    L.cache = std::make_shared<module_cache>(args["module-cache"].as<string>(), compiler_id.str());
+	}
+	else if (log_verbose >= 1)
+	    std::cerr<<"Warning: can't find the executable '"<<exe.string()<<"', so the module cache is not used.\n";
+    }
+
     return std::shared_ptr<module_loader>(new module_loader(L));
 }
 
+/// Add the model from --model or --Model, and set initial values from the command line.
+void finish_model_setup(owned_ptr<Model>& M, const variables_map& args)
+{
+    if (args.count("model"))
+    {
+	const string filename = args["model"].as<string>();
+	read_add_model(*M,filename);
+    }
+    else if (args.count("Model"))
+    {
+	const string filename = args["Model"].as<string>();
+	add_model(*M,filename);
+    }
+
+    if (args.count("tree") and M.as<Parameters>())
+    {
+	auto P = M.as<Parameters>();
+	for(int i=0;i<P->n_branch_scales();i++)
+	    P->branch_scale(i, 1.0);
+    }
+
+    set_initial_parameter_values(*M,args);
+}
+
+/// Run the chain M together with heated chains 2..n in separate threads, and swap temperatures between them.
+///
+/// Each chain gets its own module loader and model, so that the chains do not share any objects.
+/// Reference counts are not atomic, so objects must not be shared between threads.
+void run_heated_chains(variables_map& args, int argc, char* argv[], unsigned long seed,
+		       owned_ptr<Model>& M, const vector<shared_ptr<ostream>>& files, const vector<MCMC::Logger>& loggers,
+		       const string& dir_name, int subsample, const vector<string>& Rao_Blackwellize,
+		       long max_iterations, ostream& out_both)
+{
+    const int n_chains = args["chains"].as<int>();
+
+    vector<owned_ptr<Model>> chains(n_chains);
+    vector<vector<shared_ptr<ostream>>> chain_files(n_chains);
+    vector<vector<MCMC::Logger>> chain_loggers(n_chains);
+
+    chains[0].swap(M);
+    chain_files[0] = files;
+    chain_loggers[0] = loggers;
+
+    // The caches for this thread hold objects from the first chain.
+    clear_eigensystem_cache();
+    clear_transition_cache();
+
+    //---------- Create and initialize the other chains -----------//
+    for(int c=1;c<n_chains;c++)
+    {
+	std::ostringstream out_chain;
+	json info;
+
+	auto L = setup_module_loader(args, argv[0]);
+	Rules R(get_package_paths(argv[0], args));
+	owned_ptr<Model> MC = create_A_and_T_model(R, args, L, out_chain, out_chain, out_chain, info, c);
+	run_info(info, c, argc, argv);
+	MC->set_args(trailing_args(argc, argv, trailing_args_separator));
+	L.reset();
+
+	finish_model_setup(MC, args);
+
+	info["subdirectory"] = dir_name;
+	chain_files[c] = init_files(c, dir_name, argc, argv);
+	chain_loggers[c] = construct_loggers(MC, subsample, Rao_Blackwellize, c, dir_name);
+	write_initial_alignments(args, c, dir_name);
+
+	MC->clear_program();
+	MC->clear_identifiers();
+
+	*chain_files[c][0]<<out_chain.str();
+	*chain_files[c][2]<<info.dump(4)<<std::endl;
+
+	for(int i=0;i<MC->n_parameters();i++)
+	    MC->parameter_is_modifiable_reg(i);
+
+	avoid_zero_likelihood(MC, *chain_files[c][0], out_both);
+
+	do_pre_burnin(args, MC, *chain_files[c][0], out_both);
+
+	chains[c].swap(MC);
+
+	clear_eigensystem_cache();
+	clear_transition_cache();
+    }
+
+    //---------- Share the screen and error streams between threads -----------//
+    locked_streambuf locked_out(files[0]->rdbuf());
+    locked_streambuf locked_err(files[1]->rdbuf());
+    {
+	restore restore_cout(cout);
+	restore restore_cerr(cerr);
+	restore restore_clog(clog);
+
+	cout.flush(); cout.rdbuf(&locked_out);
+	cerr.flush(); cerr.rdbuf(&locked_err);
+	clog.flush(); clog.rdbuf(&locked_err);
+
+	// The first chain writes to the same file as cout.
+	ostream s_out0(&locked_out);
+
+	auto exchange = std::make_shared<MCMC::chain_exchange>(n_chains, args["swap-interval"].as<int>());
+
+	std::mutex error_mutex;
+	std::exception_ptr first_error;
+
+	// Each chain counts machine statistics in the thread that runs it.
+	vector<vector<long>> chain_counts(n_chains);
+	vector<std::pair<long,long>> chain_maxima(n_chains, {0,0});
+
+	thread_pool chain_threads(n_chains-1);
+	chain_threads.parallel_for(n_chains, [&](int c)
+	{
+	    try
+	    {
+		myrand_init(seed + c);
+		ostream& s_out = (c == 0) ? s_out0 : *chain_files[c][0];
+		do_sampling(args, chains[c], max_iterations, s_out, chain_loggers[c], {}, exchange, c);
+		s_out.flush();
+
+		// Save the counts for this chain, since the thread may go on to run another chain.
+		for(long* counter: thread_machine_counters())
+		{
+		    chain_counts[c].push_back(*counter);
+		    *counter = 0;
+		}
+		chain_maxima[c] = {total_tokens, max_version};
+	    }
+	    catch (...)
+	    {
+		{
+		    std::unique_lock<std::mutex> lock(error_mutex);
+		    if (not first_error)
+			first_error = std::current_exception();
+		}
+		exchange->abort();
+	    }
+	});
+
+	cout.flush();
+	cerr.flush();
+
+	// Add up the counts for all the chains in this thread, so that they are reported at the end.
+	auto counters = thread_machine_counters();
+	for(int c=0;c<n_chains;c++)
+	{
+	    for(int i=0;i<chain_counts[c].size();i++)
+		*counters[i] += chain_counts[c][i];
+	    total_tokens = std::max(total_tokens, chain_maxima[c].first);
+	    max_version = std::max(max_version, chain_maxima[c].second);
+	}
+
+	if (first_error)
+	    std::rethrow_exception(first_error);
+    }
+
+    chains[0].swap(M);
+}
+
+template <typename T>
+bool same_value_as(const boost::any& x, const boost::any& y, bool& same)
+{
+    auto p = boost::any_cast<T>(&x);
+    if (not p) return false;
+    same = (*p == boost::any_cast<const T&>(y));
+    return true;
+}
+
+/// Do two option values hold the same value?  Values of other types are treated as different.
+bool same_option_value(const po::variable_value& v1, const po::variable_value& v2)
+{
+    const auto& x = v1.value();
+    const auto& y = v2.value();
+    if (x.type() != y.type()) return false;
+
+    bool same = false;
+    same_value_as<string>(x, y, same) or
+	same_value_as<vector<string>>(x, y, same) or
+	same_value_as<int>(x, y, same) or
+	same_value_as<long>(x, y, same) or
+	same_value_as<unsigned long>(x, y, same) or
+	same_value_as<double>(x, y, same) or
+	same_value_as<bool>(x, y, same);
+    return same;
+}
+
 int simple_size(const expression_ref& E);
 
 int main(int argc,char* argv[])
@@ -373,6 +647,40 @@ int main(int argc,char* argv[])
 	//---------- Parse command line  ---------//
 	variables_map args = parse_cmd_line(argc,argv);
 
+	//---------- Load the command line of a run that we are resuming ---------//
+	vector<string> resumed_command;
+	vector<char*> resumed_argv;
+	if (args.count("resume"))
+	{
+	    auto resume_args = args;
+
+	    resumed_command = load_command_line(args["resume"].as<string>());
+	    resumed_command[0] = argv[0];
+	    for(auto& arg: resumed_command)
+		resumed_argv.push_back(&arg[0]);
+	    resumed_argv.push_back(nullptr);
+
+	    argc = resumed_command.size();
+	    argv = resumed_argv.data();
+	    args = parse_cmd_line(argc,argv);
+
+	    // These options may be changed when resuming.  They don't affect the samples.
+	    const std::set<string> changeable = {"iterations", "threads", "checkpoint", "package-path", "verbose", "module-cache"};
+	    for(auto& option: resume_args)
+	    {
+		if (option.first == "resume" or option.second.defaulted()) continue;
+
+		// Options from ~/.bali-phy or --config are not changes if they have the same value as in the original run.
+		if (args.count(option.first) and same_option_value(args[option.first], option.second)) continue;
+
+		if (not changeable.count(option.first))
+		    throw myexception()<<"--resume: cannot change --"<<option.first<<" when resuming a run.";
+		args.erase(option.first);
+		args.insert(option);
+	    }
+	    args.insert({"resume", resume_args["resume"]});
+	}
+
 	show_only = args.count("test");
 
 	//------ Increase precision for (cout,cerr) if we are testing ------//
@@ -388,21 +696,51 @@ int main(int argc,char* argv[])
 
 	//------------- Setup module loader -------------//
 	auto L = setup_module_loader(args, argv[0]);
-	L->pre_inline_unconditionally = args["pre-inline"].as<bool>();
-	L->post_inline_unconditionally = args["post-inline"].as<bool>();
-	L->let_float_from_case = args["let-float-from-case"].as<bool>();
-	L->let_float_from_apply = args["let-float-from-apply"].as<bool>();
-	L->let_float_from_let = args["let-float-from-let"].as<bool>();
-	L->case_of_constant = args["case-of-constant"].as<bool>();
-	L->case_of_variable = args["case-of-variable"].as<bool>();
-	L->case_of_case = args["case-of-case"].as<bool>();
-	L->inline_threshhold = args["inline-threshold"].as<int>();
-	L->keenness = args["keenness"].as<double>();
-	L->beta_reduction = args["beta-reduction"].as<bool>();
-	L->max_iterations = args["simplifier-max-iterations"].as<int>();
 
 	//---------- Initialize random seed -----------//
 	unsigned long seed = init_rng_and_get_seed(args);
+
+	//---------- Set up the worker threads -----------//
+	if (args["threads"].as<int>() < 1)
+	    throw myexception()<<"--threads: the number of threads must be at least 1.";
+	set_n_threads(args["threads"].as<int>());
+
+	//---------- Check the heated chains -----------//
+	const int n_chains = args["chains"].as<int>();
+	if (n_chains < 1)
+	    throw myexception()<<"--chains: the number of chains must be at least 1.";
+	if (n_chains > 1)
+	{
+	    if (n_procs > 1)
+		throw myexception()<<"--chains: cannot run heated chains in threads and in MPI processes at the same time.";
+	    if (not args.count("align"))
+		throw myexception()<<"--chains: heated chains require sequence data.";
+	    if (not args.count("beta"))
+		throw myexception()<<"--chains: use --beta to give a temperature for each chain.";
+	    if (args["swap-interval"].as<int>() < 1)
+		throw myexception()<<"--swap-interval: the interval must be at least 1.";
+	}
+
+	//---------- Check the checkpoint options -----------//
+	const bool resuming = args.count("resume");
+	if (args.count("checkpoint") or resuming)
+	{
+	    if (n_procs > 1 or n_chains > 1)
+		throw myexception()<<"--checkpoint and --resume cannot be used with MPI or --chains.";
+	    if (args.count("checkpoint") and args["checkpoint"].as<long int>() < 1)
+		throw myexception()<<"--checkpoint: the interval must be at least 1.";
+	}
+
+	//---------- Choose how to store conditional likelihoods -----------//
+	string precision = args["likelihood-precision"].as<string>();
+	if (precision == "double")
+	    substitution::likelihood_precision = substitution::clv_precision::double_precision;
+	else if (precision == "single")
+	    substitution::likelihood_precision = substitution::clv_precision::single_precision;
+	else if (precision == "check")
+	    substitution::likelihood_precision = substitution::clv_precision::check;
+	else
+	    throw myexception()<<"--likelihood-precision: expected 'double', 'single', or 'check', but got '"<<precision<<"'.";
     
 	if (log_verbose >= 1) out_cache<<"random seed = "<<seed<<endl<<endl;
 
@@ -468,25 +806,8 @@ int main(int argc,char* argv[])
 
 	    exit(0);
 	}
-	else if (args.count("model"))
-	{
-	    const string filename = args["model"].as<string>();
-	    read_add_model(*M,filename);
-	}
-	else if (args.count("Model"))
-	{
-	    const string filename = args["Model"].as<string>();
-	    add_model(*M,filename);
-	}
 
-	if (args.count("tree") and M.as<Parameters>())
-	{
-	    auto P = M.as<Parameters>();
-	    for(int i=0;i<P->n_branch_scales();i++)
-		P->branch_scale(i, 1.0);
-	}
-
-	set_initial_parameter_values(*M,args);
+	finish_model_setup(M, args);
 
 	//---------------Do something------------------//
 	vector<string> Rao_Blackwellize;
@@ -516,7 +837,16 @@ int main(int argc,char* argv[])
 	    vector<MCMC::Logger> loggers;
 
 	    string dir_name="";
-	    if (not args.count("test")) {
+	    if (resuming)
+	    {
+		dir_name = args["resume"].as<string>();
+		long iterations = MCMC::truncate_output_files(checkpoint_filename(proc_id, dir_name));
+
+		info["subdirectory"] = dir_name;
+		files = resume_files(proc_id, dir_name, iterations);
+		loggers = construct_loggers(M, subsample, Rao_Blackwellize, proc_id, dir_name, true);
+	    }
+	    else if (not args.count("test")) {
 #ifdef HAVE_MPI
 		if (not proc_id) {
 		    dir_name = init_dir(args);
@@ -557,7 +887,8 @@ int main(int argc,char* argv[])
 	    clog.flush() ; clog.rdbuf(files[1]->rdbuf());
 
 	    //------ Write run info to C1.json ------//
-	    *files[2]<<info.dump(4)<<std::endl;
+	    if (not resuming)
+		*files[2]<<info.dump(4)<<std::endl;
 
 	    //------ Redirect output to files -------//
 
@@ -565,9 +896,13 @@ int main(int argc,char* argv[])
 	    for(int i=0;i<M->n_parameters();i++)
 		M->parameter_is_modifiable_reg(i);
 
-	    avoid_zero_likelihood(M, *files[0], out_both);
+	    // When resuming, the state will be loaded from the checkpoint instead.
+	    if (not resuming)
+	    {
+		avoid_zero_likelihood(M, *files[0], out_both);
 
-	    do_pre_burnin(args, M, *files[0], out_both);
+		do_pre_burnin(args, M, *files[0], out_both);
+	    }
 
 	    out_screen<<"\nBAli-Phy does NOT detect how many iterations is sufficient:\n   You need to monitor convergence and kill it when done."<<endl;
 	    if (not args.count("iterations"))
@@ -589,8 +924,21 @@ int main(int argc,char* argv[])
 	    out_screen<<"You can examine 'C1.log' using BAli-Phy tool statreport (command-line) or the BEAST program Tracer (graphical).\n"<<endl;
 	    out_screen<<"See the manual at http://www.bali-phy.org/README.xhtml for further information."<<endl;
 
+	    //-------- Set up checkpoints -----------//
+	    MCMC::checkpoint_settings checkpoints;
+	    checkpoints.filename = checkpoint_filename(proc_id, dir_name);
+	    if (args.count("checkpoint"))
+	    {
+		checkpoints.interval = args["checkpoint"].as<long int>();
+		checkpoints.output_files = chain_output_files(proc_id, dir_name);
+	    }
+	    checkpoints.resume = resuming;
+
 	    //-------- Start the MCMC  -----------//
-	    do_sampling(args, M, max_iterations, *files[0], loggers);
+	    if (n_chains > 1)
+		run_heated_chains(args, argc, argv, seed, M, files, loggers, dir_name, subsample, Rao_Blackwellize, max_iterations, out_both);
+	    else
+		do_sampling(args, M, max_iterations, *files[0], loggers, checkpoints);
 
 	    // Close all the streams, and write a notification that we finished all the iterations.
 	    // close_files(files);
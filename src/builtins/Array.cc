@@ -54,7 +54,7 @@ extern "C" closure builtin_function_arraySize(OperationArgs& Args)
 
 extern "C" closure builtin_function_getIndex(OperationArgs& Args)
 {
-    extern long total_index_op;
+    extern thread_local long total_index_op;
     total_index_op++;
 
     int n = Args.evaluate(1).as_int();
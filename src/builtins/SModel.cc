@@ -29,6 +29,32 @@ extern "C" closure builtin_function_lExp(OperationArgs& Args)
     return M;
 }
 
+extern "C" closure builtin_function_lExps(OperationArgs& Args)
+{
+    auto arg0 = Args.evaluate(0);
+    auto arg1 = Args.evaluate(1);
+    auto arg2 = Args.evaluate(2);
+
+    const EVector& Ls = arg0.as_<EVector>();
+    const EVector& pis = arg1.as_<EVector>();
+    const EVector& ts = arg2.as_<EVector>();
+
+    vector<object_ptr<const EigenValues>> eigensystems;
+    vector<const vector<double>*> pi;
+    vector<double> t;
+    for(int i=0;i<Ls.size();i++)
+    {
+	eigensystems.push_back(Ls[i].assert_is_a<EigenValues>());
+	pi.push_back(&pis[i].as_<Vector<double>>());
+	t.push_back(ts[i].as_double());
+    }
+
+    object_ptr<EVector> Ps(new EVector);
+    for(auto& P: cached_exp(eigensystems, pi, t))
+	Ps->push_back(P);
+    return Ps;
+}
+
 extern "C" closure builtin_function_reversible_rate_matrix(OperationArgs& Args)
 {
     auto arg0 = Args.evaluate(0);
@@ -116,7 +142,7 @@ extern "C" closure builtin_function_get_eigensystem(OperationArgs& Args)
 	}
 
     //---------------- Compute eigensystem ------------------//
-    return {new EigenValues(S)};
+    return cached_eigensystem(S, pi);
 }
 
 
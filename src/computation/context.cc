@@ -24,8 +24,8 @@ using boost::optional;
 using std::cerr;
 using std::endl;
 
-long total_create_context1 = 0;
-long total_create_context2 = 0;
+thread_local long total_create_context1 = 0;
+thread_local long total_create_context2 = 0;
 
 object_ptr<reg_heap>& context::memory() const {return memory_;}
 
@@ -29,7 +29,21 @@ expression_ref module_loader::read_module_from_file(const string& filename) cons
 	if (not modules.count(filename))
 	{
 	    string file_contents = read_file(filename,"module");
-	    modules[filename] = parse_module_file(file_contents);
+	    if (cache)
+	    {
+		string hash = cache->source_hash(file_contents);
+		source_hashes[filename] = hash;
+
+		if (auto parsed = cache->load_parsed(hash))
+		    modules[filename] = *parsed;
+		else
+		{
+		    modules[filename] = parse_module_file(file_contents);
+		    cache->save_parsed(hash, modules[filename]);
+		}
+	    }
+	    else
+		modules[filename] = parse_module_file(file_contents);
 	}
 
 	return modules[filename];
@@ -85,7 +99,10 @@ Module module_loader::load_module_from_file(const string& filename) const
 	expression_ref module = read_module_from_file(filename);
 
 	Module M(module);
-    
+
+	if (source_hashes.count(filename))
+	    M.source_hash = source_hashes.at(filename);
+
 	return M;
     }
     catch (myexception& e)
@@ -112,7 +129,7 @@ module_loader::module_loader(const vector<fs::path>& path_list)
 
 #include <dlfcn.h>
 
-expression_ref load_builtin_(const string& filename, const string& symbol_name, int n, const string& fname)
+Operation load_builtin_operation(const string& symbol_name, const string& filename, int n, const string& fname)
 {
     // If not, then I think its treated as being already in WHNF, and not evaluated.
     if (n < 1) throw myexception()<<"A builtin must have at least 1 argument";
@@ -132,15 +149,13 @@ expression_ref load_builtin_(const string& filename, const string& symbol_name,
 	throw myexception() << "Cannot load symbol for builtin '"<<fname<<"' from file '"<<filename<<": " << dlsym_error;
     
     // Create the operation
-    Operation O(n, (operation_fn)fn, fname);
-
-    // Create the function body from it.
-    return lambda_expression(O);
+    return Operation(n, (operation_fn)fn, fname);
 }
 
 expression_ref load_builtin(const string& symbol_name, const string& filename, int n, const string& function_name)
 {
-    return load_builtin_(filename, symbol_name, n, function_name);
+    // Create the function body from the operation.
+    return lambda_expression( load_builtin_operation(symbol_name, filename, n, function_name) );
 }
 
 string module_loader::find_plugin(const string& plugin_name) const
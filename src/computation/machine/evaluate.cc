@@ -16,15 +16,15 @@ using std::pair;
 #include "computation/operations.H"
 #include "computation/computation.H"
 
-long total_reductions = 0;
-long total_changeable_reductions = 0;
-long total_changeable_eval = 0;
-long total_changeable_eval_with_result = 0;
-long total_changeable_eval_with_call = 0;
-
-long total_case_op = 0;
-long total_let_op = 0;
-long total_index_op = 0;
+thread_local long total_reductions = 0;
+thread_local long total_changeable_reductions = 0;
+thread_local long total_changeable_eval = 0;
+thread_local long total_changeable_eval_with_result = 0;
+thread_local long total_changeable_eval_with_call = 0;
+
+thread_local long total_case_op = 0;
+thread_local long total_let_op = 0;
+thread_local long total_index_op = 0;
 
 expression_ref compact_graph_expression(const reg_heap& C, int R, const map<string, int>&);
 expression_ref untranslate_vars(const expression_ref& E, const map<string, int>& ids);
@@ -1,3 +1,4 @@
+#include <chrono>
 #include "graph_register.H"
 
 using std::vector;
@@ -10,10 +11,14 @@ void shrink(V& v)
     v.swap(v2);
 }
 
-long total_gc = 0;
-long total_regs = 0;
-long total_steps = 0;
-long total_comps = 0;
+const int min_nursery_size = 1<<10;
+const int max_nursery_size = 1<<24;
+
+thread_local long total_gc = 0;
+thread_local long total_young_gc = 0;
+thread_local long total_regs = 0;
+thread_local long total_steps = 0;
+thread_local long total_comps = 0;
 void reg_heap::collect_garbage()
 {
     total_gc++;
@@ -21,10 +26,12 @@ void reg_heap::collect_garbage()
     total_steps = steps.size();
     total_comps = results.size();
 
-    // Avoid memory leaks.  But can we do this faster?
+    // Avoid memory leaks: release the unused capacity of the token mappings.
+    for(auto& token: tokens)
     {
-	vector<Token> new_tokens = tokens;
-	std::swap(new_tokens, tokens);
+	shrink(token.vm_step.delta());
+	shrink(token.vm_result.delta());
+	shrink(token.children);
     }
 #ifdef DEBUG_MACHINE
     std::cerr<<"***********Garbage Collection******************"<<std::endl;
@@ -32,7 +39,7 @@ void reg_heap::collect_garbage()
 #endif
     assert(size() == n_used() + n_free() + n_null());
 
-    trace_and_reclaim_unreachable();
+    trace_and_reclaim_unreachable(false);
 
 #ifdef DEBUG_MACHINE
     std::cerr<<"Regs: "<<n_used()<<"/"<<size()<<std::endl;
@@ -40,6 +47,36 @@ void reg_heap::collect_garbage()
 #endif
 }
 
+// Most regs, steps, and results die young: they are created while evaluating a proposal,
+// and become garbage when the proposal is rejected or replaced.  A collection of the
+// young generation only traces and reclaims objects allocated since the last collection.
+// It treats every old object as live, so old garbage waits for the next full collection.
+//
+// An old object that gains a reference to a young object is put on a remembered list
+// by set_C( ), set_call( ), set_used_input( ), set_result_value_for_reg( ), and
+// set_reg_value( ), which are the only places where those references are created.
+// Any allocation can run a collection, so an object created just before an allocation
+// may already be old when its fields are set afterwards.
+
+int reg_heap::collect_young_garbage()
+{
+    total_young_gc++;
+
+    auto start = std::chrono::steady_clock::now();
+
+    int n_reclaimed = trace_and_reclaim_unreachable(true);
+
+    // Adjust the number of regs allocated between young collections to keep their pauses
+    // near the budget.
+    double pause = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    if (pause > gc_pause_budget)
+	nursery_size = std::max(min_nursery_size, nursery_size/2);
+    else if (pause < gc_pause_budget/4 and nursery_size < max_nursery_size)
+	nursery_size *= 2;
+
+    return n_reclaimed;
+}
+
 void do_remap(const reg_heap& M, vector<int>& remap, int r)
 {
     if (remap[r]) return;
@@ -133,15 +170,17 @@ void do_remap(const reg_heap& M, vector<int>& remap, int r)
   }
 */
 
-void reg_heap::trace(vector<int>& remap)
+void reg_heap::trace(vector<int>& remap, bool young_only)
 {
     // 1. Set up lists for used/marked regs, steps, and results.
+    //    When collecting the young generation, old objects are live and are not marked or traced.
     vector<int>& used_regs = get_scratch_list();
     vector<int>& used_steps = get_scratch_list();
     vector<int>& used_results = get_scratch_list();
 
-    auto mark_reg = [this,&used_regs](int r) {
+    auto mark_reg = [this,&used_regs,young_only](int r) {
 	assert(r > 0);
+	if (young_only and not is_young(r)) return;
 	if (not is_marked(r))
 	{
 	    set_mark(r);
@@ -149,8 +188,9 @@ void reg_heap::trace(vector<int>& remap)
 	}
     };
 
-    auto mark_step = [this,&used_steps](int s) {
+    auto mark_step = [this,&used_steps,young_only](int s) {
 	assert(s > 0);
+	if (young_only and not steps.is_young(s)) return;
 	if (not steps.is_marked(s))
 	{
 	    steps.set_mark(s);
@@ -158,8 +198,9 @@ void reg_heap::trace(vector<int>& remap)
 	}
     };
 
-    auto mark_result = [this,&used_results](int r) {
+    auto mark_result = [this,&used_results,young_only](int r) {
 	assert(r > 0);
+	if (young_only and not results.is_young(r)) return;
 	if (not results.is_marked(r))
 	{
 	    results.set_mark(r);
@@ -212,7 +253,7 @@ void reg_heap::trace(vector<int>& remap)
 	    int r = p.first;
 	    if (access(r).n_heads)
 	    {
-		assert(is_marked(r));
+		assert(survives(r, young_only));
 		int step = p.second;
 		if (step > 0)
 		    mark_step(step);
@@ -227,7 +268,7 @@ void reg_heap::trace(vector<int>& remap)
 	    int r = p.first;
 	    if (access(r).n_heads)
 	    {
-		assert(is_marked(r));
+		assert(survives(r, young_only));
 		int result = p.second;
 		if (result > 0)
 		    mark_result(result);
@@ -235,6 +276,29 @@ void reg_heap::trace(vector<int>& remap)
 	}
     }
 
+    // 5.3 Mark the young objects referenced by old objects that have changed since the last collection.
+    if (young_only)
+    {
+	for(int r: remembered())
+	    if (is_used(r))
+		for(int r2: access(r).C.Env)
+		    mark_reg(r2);
+
+	for(int s: steps.remembered())
+	    if (steps.is_used(s))
+	    {
+		const auto& S = steps[s];
+		if (S.call > 0)
+		    mark_reg(S.call);
+		for(const auto& rc: S.used_inputs)
+		    mark_result(rc.first);
+	    }
+
+	for(int rc: results.remembered())
+	    if (results.is_used(rc) and results[rc].call_edge.first > 0)
+		mark_result(results[rc].call_edge.first);
+    }
+
     // 6. Trace unwalked steps and results
     int step_index = 0, result_index = 0;
 
@@ -277,9 +341,9 @@ void reg_heap::trace(vector<int>& remap)
     for(int r:used_results)
     {
 	const auto& result = results[r];
-	assert(steps.is_marked(result.source_step));
+	assert(steps.survives(result.source_step, young_only));
 	assert(result.source_reg == steps[result.source_step].source_reg);
-	assert(is_marked(results[r].source_reg));
+	assert(survives(results[r].source_reg, young_only));
     }
 
     // 8. Mark regs referenced only by regs as used.
@@ -311,7 +375,7 @@ void reg_heap::trace(vector<int>& remap)
 }
 
 template <typename Obj>
-void unmap_unused(mapping& vm, pool<Obj>& Objs, pool<reg>& regs)
+void unmap_unused(mapping& vm, pool<Obj>& Objs, pool<reg>& regs, bool young_only)
 {
     auto& delta = vm.delta();
     for(int i=0; i < delta.size();)
@@ -323,14 +387,14 @@ void unmap_unused(mapping& vm, pool<Obj>& Objs, pool<reg>& regs)
 	// We can't have: obj > 0, Obj marked, reg unmarked.  That would be bad.
 
         // if there's a step mapped that is going to be destroyed, then remove the mapping.
-	if (not regs.is_marked(reg))
+	if (not regs.survives(reg, young_only))
 	{
-	    assert(obj <= 0 or not Objs.is_marked(obj));
+	    assert(obj <= 0 or not Objs.survives(obj, young_only));
 	    vm.erase_value_at(i);
 	}
 	else
 	{
-	    if (obj > 0 and not Objs.is_marked(obj))
+	    if (obj > 0 and not Objs.survives(obj, young_only))
 		obj = -1;
 	    i++;
 	}
@@ -356,7 +420,20 @@ void unmap_unused(vector<int>& prog, pool<Obj>& Objs, pool<reg>& regs)
     }
 }
 
-void reg_heap::trace_and_reclaim_unreachable()
+// Only young steps/results can be destroyed, and each one can only be mapped at its source reg.
+template <typename Obj>
+void unmap_unused_young(vector<int>& prog, pool<Obj>& Objs)
+{
+    for(int obj: Objs.young())
+	if (Objs.is_used(obj))
+	{
+	    int r = Objs[obj].source_reg;
+	    if (prog[r] == obj)
+		prog[r] = 0;
+	}
+}
+
+int reg_heap::trace_and_reclaim_unreachable(bool young_only)
 {
 #ifdef DEBUG_MACHINE
     check_used_regs();
@@ -369,7 +446,7 @@ void reg_heap::trace_and_reclaim_unreachable()
     for(int i=0;i<remap.size();i++)
 	remap[i] = 0;
 
-    trace(remap);
+    trace(remap, young_only);
 
 #ifdef DEBUG_MACHINE
     check_used_regs();
@@ -379,61 +456,109 @@ void reg_heap::trace_and_reclaim_unreachable()
     for(int t=0; t < get_n_tokens(); t++)
 	if (token_is_used(t))
 	{
-	    if (is_root_token(t))
+	    if (is_root_token(t) and young_only)
+	    {
+		unmap_unused_young(prog_steps, steps);
+		unmap_unused_young(prog_results, results);
+	    }
+	    else if (is_root_token(t))
 	    {
 		unmap_unused(prog_steps, steps, *this);
 		unmap_unused(prog_results, results, *this);
 	    }
 	    else
 	    {
-		unmap_unused(tokens[t].vm_step, steps, *this);
-		unmap_unused(tokens[t].vm_result, results, *this);
+		unmap_unused(tokens[t].vm_step, steps, *this, young_only);
+		unmap_unused(tokens[t].vm_result, results, *this, young_only);
 	    }
 	}
 
-    // remove all back-edges
-    for(auto i = steps.begin();i != steps.end(); i++)
-	if (not steps.is_marked(i.addr()))
-	    clear_back_edges_for_step(i.addr());
+    int n_reclaimed = 0;
+    if (young_only)
+    {
+	// Young objects that are used but not marked are unreachable.
+	for(int s: steps.young())
+	    if (steps.is_used(s))
+		clear_back_edges_for_step(s);
+
+	for(int r: young())
+	    if (is_used(r))
+		clear_back_edges_for_reg(r);
+
+	n_reclaimed = reclaim_unmarked_young();
 
-    for(auto i = begin();i != end(); i++)
-	if (not is_marked(i.addr()))
-	    clear_back_edges_for_reg(i.addr());
+	steps.reclaim_unmarked_young();
 
-    reclaim_unmarked();
+	for(int rc: results.young())
+	    if (results.is_used(rc))
+		clear_back_edges_for_result(rc);
+
+	results.reclaim_unmarked_young();
+    }
+    else
+    {
+	// remove all back-edges
+	for(auto i = steps.begin();i != steps.end(); i++)
+	    if (not steps.is_marked(i.addr()))
+		clear_back_edges_for_step(i.addr());
 
-    steps.reclaim_unmarked();
+	for(auto i = begin();i != end(); i++)
+	    if (not is_marked(i.addr()))
+		clear_back_edges_for_reg(i.addr());
 
-    // remove all back-edges
-    for(auto i = results.begin();i != results.end(); i++)
-	if (not results.is_marked(i.addr()))
-	    clear_back_edges_for_result(i.addr());
+	n_reclaimed = reclaim_unmarked();
 
-    // check that no freed computations are mapped?
+	steps.reclaim_unmarked();
+
+	// remove all back-edges
+	for(auto i = results.begin();i != results.end(); i++)
+	    if (not results.is_marked(i.addr()))
+		clear_back_edges_for_result(i.addr());
+
+	// check that no freed computations are mapped?
   
-    results.reclaim_unmarked();
+	results.reclaim_unmarked();
+    }
 
 #ifdef DEBUG_MACHINE
     check_used_regs();
 #endif
 
     // remap closures not to point through index_vars
-    for(reg& R: *this)
-	for(int& r2: R.C.Env)
+    auto remap_closure = [&](closure& C) {
+	for(int& r2: C.Env)
 	{
 	    assert(is_used(r2));
+	    do_remap(*this, remap, r2);
 	    r2 = remap[r2];
 	    assert(is_used(r2));
 	}
+    };
+
+    // A young collection only remaps new or changed closures.  A full collection remaps the rest.
+    if (young_only)
+    {
+	for(int r: young())
+	    if (is_used(r))
+		remap_closure(access(r).C);
+	for(int r: remembered())
+	    if (is_used(r))
+		remap_closure(access(r).C);
+    }
+    else
+	for(reg& R: *this)
+	    remap_closure(R.C);
 
     for(auto& C: closure_stack)
-	for(int& r2: C.Env)
-	{
-	    assert(is_used(r2));
-	    r2 = remap[r2];
-	    assert(is_used(r2));
-	}
+	remap_closure(C);
+
+    // Everything that survived is now old.
+    promote_young();
+    steps.promote_young();
+    results.promote_young();
 
     //  release_scratch_list();
     release_scratch_list();
+
+    return n_reclaimed;
 }
@@ -14,16 +14,16 @@ using std::endl;
 
 using boost::optional;
 
-long total_reg_allocations = 0;
-long total_step_allocations = 0;
-long total_comp_allocations = 0;
-long total_set_reg_value = 0;
-long total_get_reg_value = 0;
-long total_get_reg_value_non_const = 0;
-long total_get_reg_value_non_const_with_result = 0;
-long total_context_pr = 0;
-long total_tokens = 0;
-long max_version = 0;
+thread_local long total_reg_allocations = 0;
+thread_local long total_step_allocations = 0;
+thread_local long total_comp_allocations = 0;
+thread_local long total_set_reg_value = 0;
+thread_local long total_get_reg_value = 0;
+thread_local long total_get_reg_value_non_const = 0;
+thread_local long total_get_reg_value_non_const_with_result = 0;
+thread_local long total_context_pr = 0;
+thread_local long total_tokens = 0;
+thread_local long max_version = 0;
 
 /*
  * Goal: Share computation of WHNF structures between contexts, even when those
@@ -89,11 +89,6 @@ long max_version = 0;
  *    loop until no more regs (and thus computations) are being freed.
  */
 
-bool null(const CacheList<int>::iterator& i)
-{
-    return (i == CacheList<int>::iterator());
-}
-
 void Step::clear()
 {
     source_reg = -1;
@@ -138,8 +133,9 @@ void Result::clear()
     source_reg = -1;
     value = 0;
     truncate(call_edge);
-    truncate(used_by);
-    truncate(called_by);
+    // Keep the capacity of the edge arrays, since the result will be reused.
+    used_by.clear();
+    called_by.clear();
 
     // This should already be cleared.
     assert(flags.none());
@@ -210,7 +206,6 @@ void reg::check_cleared()
     assert(type == type_t::unknown);
     assert(n_heads == 0);
     assert(created_by.first == 0);
-    assert(null(created_by.second));
 }
 
 void mapping::add_value(int r, int v) 
@@ -573,9 +568,10 @@ void reg_heap::set_result_value_for_reg(int r1)
 
     // Add a called-by edge to R2.
     int rc2 = result_index_for_reg(call);
-    auto back_edge = results[rc2].called_by.push_back(rc1);
-    RC1.call_edge.first = rc2;
-    RC1.call_edge.second = back_edge;
+    auto& called_by = results[rc2].called_by;
+    RC1.call_edge = {rc2, int(called_by.size())};
+    called_by.push_back(rc1);
+    results.remember(rc1);
 }
 
 void reg_heap::set_used_input(int s1, int R2)
@@ -595,8 +591,11 @@ void reg_heap::set_used_input(int s1, int R2)
 
     int rc2 = result_index_for_reg(R2);
 
-    auto back_edge = results[rc2].used_by.push_back(s1);
-    steps[s1].used_inputs.push_back({rc2,back_edge});
+    auto& used_inputs = steps[s1].used_inputs;
+    auto& used_by = results[rc2].used_by;
+    used_by.push_back({s1, int(used_inputs.size())});
+    used_inputs.push_back({rc2, int(used_by.size())-1});
+    steps.remember(s1);
 
     assert(result_is_used_by(s1,rc2));
 }
@@ -623,6 +622,7 @@ void reg_heap::set_call(int R1, int R2)
 
     // Set the call
     step_for_reg(R1).call = R2;
+    steps.remember(step_index_for_reg(R1));
 }
 
 void reg_heap::clear_call(int s)
@@ -644,6 +644,7 @@ void reg_heap::set_C(int R, closure&& C)
     clear_C(R);
 
     access(R).C = std::move(C);
+    remember(R);
 #ifndef NDEBUG
     for(int r: access(R).C.Env)
 	assert(is_valid_address(r));
@@ -659,10 +660,10 @@ void reg_heap::mark_reg_created_by_step(int r, int s)
 {
     assert(r > 0);
     assert(s > 0);
-    steps[s].created_regs.push_front(r);
     assert(access(r).created_by.first == 0);
-    assert(null(access(r).created_by.second));
-    access(r).created_by = {s,steps[s].created_regs.begin()};
+    auto& created_regs = steps[s].created_regs;
+    access(r).created_by = {s, int(created_regs.size())};
+    created_regs.push_back(r);
 }
 
 int reg_heap::create_reg_from_step(int s)
@@ -736,6 +737,8 @@ void reg_heap::set_reg_value(int R, closure&& value, int t)
 
 	// clear 'reg created' edge from s to old call.
 	steps[s].call = R2;
+	// Allocating R2 may have run a collection that made s old.
+	steps.remember(s);
 
 	// Set the call
 	set_C(R2, std::move( value ) );
@@ -822,7 +825,6 @@ void reg_heap::reclaim_used(int r)
 {
     // Mark this reg as not used (but not free) so that we can stop worrying about upstream objects.
     assert(not access(r).created_by.first);
-    assert(null(access(r).created_by.second));
     assert(not has_step(r));
   
     pool<reg>::reclaim_used(r);
@@ -899,8 +901,21 @@ void reg_heap::pop_temp_head()
 
 void reg_heap::get_more_memory()
 {
-    collect_garbage();
-    base_pool_t::get_more_memory();
+    // Most new regs are garbage, so collecting the young generation often frees enough regs.
+    int n_reclaimed = collect_young_garbage();
+    if (n_reclaimed == 0 or n_reclaimed < size()/8)
+    {
+	collect_garbage();
+	base_pool_t::get_more_memory();
+    }
+}
+
+int reg_heap::get_free_element()
+{
+    if (n_young() >= nursery_size)
+	collect_young_garbage();
+
+    return base_pool_t::get_free_element();
 }
 
 void reg_heap::expand_memory(int s)
@@ -955,8 +970,8 @@ bool reg_heap::result_is_called_by(int rc1, int rc2) const
 
 bool reg_heap::result_is_used_by(int s1, int rc2) const
 {
-    for(int s: results[rc2].used_by)
-	if (s == s1)
+    for(auto& edge: results[rc2].used_by)
+	if (edge.first == s1)
 	    return true;
 
     return false;
@@ -1184,18 +1199,14 @@ int reg_heap::add_shared_result(int r, int s)
 void reg_heap::check_back_edges_cleared_for_step(int s)
 {
     for(auto& rcp: steps.access_unused(s).used_inputs)
-	assert(null(rcp.second));
-    for(auto& r: steps.access_unused(s).created_regs)
-    {
-	auto& created_by = access(r).created_by;
-	assert(created_by.first == 0);
-	assert(null(created_by.second));
-    }
+	assert(rcp.second == -1);
+    for(int r: steps.access_unused(s).created_regs)
+	assert(access(r).created_by.first == 0);
 }
 
 void reg_heap::check_back_edges_cleared_for_result(int rc)
 {
-    assert(null(results.access_unused(rc).call_edge.second));
+    assert(not results.access_unused(rc).call_edge.first);
 }
 
 void reg_heap::clear_back_edges_for_reg(int r)
@@ -1205,9 +1216,8 @@ void reg_heap::clear_back_edges_for_reg(int r)
     int s = created_by.first;
     if (s > 0)
     {
-	steps[s].created_regs.erase(created_by.second);
-	created_by.first = 0;
-	created_by.second = {};
+	erase_created_reg(s, created_by.second);
+	created_by = {0,0};
     }
 }
 
@@ -1216,11 +1226,11 @@ void reg_heap::clear_back_edges_for_step(int s)
     assert(s > 0);
     for(auto& rcp: steps[s].used_inputs)
     {
-	results[rcp.first].used_by.erase(rcp.second);
-	rcp.second = {};
+	erase_used_by_edge(rcp.first, rcp.second);
+	rcp.second = -1;
     }
-    for(auto& r: steps[s].created_regs)
-	access(r).created_by = {0,{}};
+    for(int r: steps[s].created_regs)
+	access(r).created_by = {0,0};
     steps[s].created_regs.clear();
 }
 
@@ -1233,9 +1243,56 @@ void reg_heap::clear_back_edges_for_result(int rc)
     if (call)
     {
 	assert(results[rc].value);
-	auto back_edge = results[rc].call_edge.second;
-	results[call].called_by.erase(back_edge);
-	results[rc].call_edge = {0,{}};
+	erase_called_by_edge(call, results[rc].call_edge.second);
+	results[rc].call_edge = {0,0};
+    }
+}
+
+// The edge arrays are unordered: we move the last edge into the hole, and then update
+// the index stored at the other end of the moved edge.
+
+void reg_heap::erase_used_by_edge(int rc, int index)
+{
+    auto& used_by = results[rc].used_by;
+    assert(0 <= index and index < used_by.size());
+
+    auto back = used_by.back();
+    used_by.pop_back();
+
+    if (index < used_by.size())
+    {
+	used_by[index] = back;
+	steps.access_unused(back.first).used_inputs[back.second].second = index;
+    }
+}
+
+void reg_heap::erase_called_by_edge(int rc, int index)
+{
+    auto& called_by = results[rc].called_by;
+    assert(0 <= index and index < called_by.size());
+
+    int back = called_by.back();
+    called_by.pop_back();
+
+    if (index < called_by.size())
+    {
+	called_by[index] = back;
+	results.access_unused(back).call_edge.second = index;
+    }
+}
+
+void reg_heap::erase_created_reg(int s, int index)
+{
+    auto& created_regs = steps[s].created_regs;
+    assert(0 <= index and index < created_regs.size());
+
+    int back = created_regs.back();
+    created_regs.pop_back();
+
+    if (index < created_regs.size())
+    {
+	created_regs[index] = back;
+	access_unused(back).created_by.second = index;
     }
 }
 
@@ -10,15 +10,15 @@ using std::pair;
 using std::cerr;
 using std::endl;
 
-long total_steps_pivoted = 0;
-long total_results_pivoted = 0;
-long total_reroot = 0;
-long total_reroot_one = 0;
-long total_invalidate = 0;
-long total_steps_invalidated = 0;
-long total_results_invalidated = 0;
-long total_steps_scanned = 0;
-long total_results_scanned = 0;
+thread_local long total_steps_pivoted = 0;
+thread_local long total_results_pivoted = 0;
+thread_local long total_reroot = 0;
+thread_local long total_reroot_one = 0;
+thread_local long total_invalidate = 0;
+thread_local long total_steps_invalidated = 0;
+thread_local long total_results_invalidated = 0;
+thread_local long total_steps_scanned = 0;
+thread_local long total_results_scanned = 0;
 
 // Given a mapping (m1,v1) at the root followed by the relative mapping (m2,v2), construct a new mapping
 // where (m2,v2) is at the root and (m1,v1) is relative.
@@ -201,8 +201,9 @@ void reg_heap::unshare_regs(int t)
 	}
 
 	// Look at step that use the root's result (that is overridden in t)
-	for(int s2: Result.used_by)
+	for(auto& edge: Result.used_by)
 	{
+	    int s2 = edge.first;
 	    auto& S2 = steps[s2];
 	    int r2 = S2.source_reg;
 
@@ -8,8 +8,8 @@ using std::pair;
 using std::cerr;
 using std::endl;
 
-long total_destroy_token = 0;
-long total_release_knuckle = 0;
+thread_local long total_destroy_token = 0;
+thread_local long total_release_knuckle = 0;
 
 void reg_heap::destroy_all_computations_in_token(int t)
 {
@@ -26,11 +26,10 @@ void reg_heap::destroy_all_computations_in_token(int t)
 	    {
 //            We can't reclaim regs here, because we would have to search for their steps/results.
 //            Instead just clear them, and wait for GC to eliminate them, and also their steps/results.
-//		access(r).created_by = {0,{}};
+//		access(r).created_by = {0,0};
 //		reclaim_used(r);
 		truncate(access(r));
 	    }
-	    steps[s].created_regs.clear();
 	    clear_back_edges_for_step(s);
 	}
     }
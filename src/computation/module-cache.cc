@@ -0,0 +1,565 @@
+#include "computation/module-cache.H"
+
+#include <sstream>
+#include <iomanip>
+#include <fstream>
+#include <typeinfo>
+#include <cstdint>
+#include <boost/filesystem/operations.hpp>
+
+#include "computation/loader.H"
+#include "computation/program.H"
+#include "computation/operations.H"
+#include "computation/expression/var.H"
+#include "computation/expression/constructor.H"
+#include "computation/expression/AST_node.H"
+#include "computation/expression/lambda.H"
+#include "computation/expression/let.H"
+#include "computation/expression/expression.H"
+#include "myexception.H"
+#include "io.H"
+#include "util/binary-io.H"
+
+namespace fs = boost::filesystem;
+
+using std::string;
+using std::vector;
+using std::map;
+using std::set;
+using std::ostream;
+using std::istream;
+using boost::optional;
+
+namespace
+{
+    const string cache_header = "BAli-Phy module cache";
+
+    // Increase this when the format, or the information stored in a Module, changes.
+    const long cache_version = 1;
+
+    // Two 64-bit FNV-1a hashes with different offsets.
+    string hash_string(const string& s)
+    {
+	std::uint64_t h1 = 0xcbf29ce484222325ULL;
+	std::uint64_t h2 = 0x84222325cbf29ce4ULL;
+	for(unsigned char c: s)
+	{
+	    h1 = (h1 ^ c) * 0x100000001b3ULL;
+	    h2 = (h2 ^ c) * 0x100000001b3ULL;
+	}
+	std::ostringstream o;
+	o<<std::hex<<std::setfill('0')<<std::setw(16)<<h1<<std::setw(16)<<h2;
+	return o.str();
+    }
+
+    //-------------------------------- Writing -----------------------------------//
+
+    enum class tag: char {null, integer, real, log_real, character, index_var, expression, var, constructor,
+			  ast_node, string, lambda, lambda2, let, apply, case_, let2, modifiable, operation};
+
+    template <typename T>
+    bool is_exactly(const expression_ref& E)
+    {
+	return typeid(*E.ptr()) == typeid(T);
+    }
+
+    // Throws if E contains an object that can't be written.  The module then isn't cached.
+    void write_expression(ostream& o, const expression_ref& E)
+    {
+	switch(E.type())
+	{
+	case null_type:
+	    write_binary(o, tag::null);
+	    return;
+	case int_type:
+	    write_binary(o, tag::integer);
+	    write_binary(o, E.as_int());
+	    return;
+	case double_type:
+	    write_binary(o, tag::real);
+	    write_binary(o, E.as_double());
+	    return;
+	case log_double_type:
+	    write_binary(o, tag::log_real);
+	    write_binary(o, E.as_log_double().log());
+	    return;
+	case char_type:
+	    write_binary(o, tag::character);
+	    write_binary(o, E.as_char());
+	    return;
+	case index_var_type:
+	    write_binary(o, tag::index_var);
+	    write_binary(o, E.as_index_var());
+	    return;
+	case expression_type:
+	    write_binary(o, tag::expression);
+	    write_expression(o, E.head());
+	    write_binary<long>(o, E.size());
+	    for(auto& e: E.sub())
+		write_expression(o, e);
+	    return;
+	default:
+	    break;
+	}
+
+	if (E.type() == var_type and is_exactly<var>(E))
+	{
+	    auto& x = E.as_<var>();
+	    write_binary(o, tag::var);
+	    write_binary(o, x.name);
+	    write_binary(o, x.index);
+	    write_binary(o, x.work_dup);
+	    write_binary(o, x.code_dup);
+	    write_binary(o, x.context);
+	    write_binary(o, x.is_loop_breaker);
+	    write_binary(o, x.top_level);
+	    write_binary(o, x.is_exported);
+	}
+	else if (E.type() == constructor_type and is_exactly<constructor>(E))
+	{
+	    auto& c = E.as_<constructor>();
+	    write_binary(o, tag::constructor);
+	    write_binary(o, c.f_name);
+	    write_binary(o, c.n_args_);
+	    write_binary(o, c.assoc);
+	    write_binary(o, c.prec);
+	}
+	else if (E.is_a<AST_node>() and is_exactly<AST_node>(E))
+	{
+	    auto& n = E.as_<AST_node>();
+	    write_binary(o, tag::ast_node);
+	    write_binary(o, n.type);
+	    write_binary(o, n.value);
+	}
+	else if (E.is_a<String>() and is_exactly<String>(E))
+	{
+	    write_binary(o, tag::string);
+	    write_binary(o, string(E.as_<String>()));
+	}
+	else if (E.type() == lambda_type and is_exactly<lambda>(E))
+	    write_binary(o, tag::lambda);
+	else if (E.type() == lambda2_type and is_exactly<lambda2>(E))
+	    write_binary(o, tag::lambda2);
+	else if (E.type() == let_type and is_exactly<let_obj>(E))
+	    write_binary(o, tag::let);
+	else if (E.type() == apply_type and is_exactly<Apply>(E))
+	    write_binary(o, tag::apply);
+	else if (E.type() == case_type and is_exactly<Case>(E))
+	    write_binary(o, tag::case_);
+	else if (E.type() == let2_type and is_exactly<Let>(E))
+	    write_binary(o, tag::let2);
+	else if (E.type() == modifiable_type and is_exactly<modifiable>(E))
+	    write_binary(o, tag::modifiable);
+	// Builtins are named "<plugin>:<symbol>" by parse_builtin( ), and are loaded again when read.
+	else if (E.type() == operation_type and is_exactly<Operation>(E) and E.as_<Operation>().name().find(':') != string::npos)
+	{
+	    auto& O = E.as_<Operation>();
+	    write_binary(o, tag::operation);
+	    write_binary(o, O.name());
+	    write_binary(o, O.n_args());
+	}
+	else
+	    throw myexception()<<"Can't write '"<<E<<"' to the module cache.";
+    }
+
+    void write_symbol_info(ostream& o, const symbol_info& S)
+    {
+	write_binary(o, S.name);
+	write_binary(o, S.symbol_type);
+	write_binary(o, S.arity);
+	write_binary(o, S.precedence);
+	write_binary(o, S.fixity);
+	write_expression(o, S.type);
+    }
+
+    void write_symbols(ostream& o, const map<string,symbol_info>& symbols)
+    {
+	write_binary<long>(o, symbols.size());
+	for(auto& s: symbols)
+	{
+	    write_binary(o, s.first);
+	    write_symbol_info(o, s.second);
+	}
+    }
+
+    //-------------------------------- Reading -----------------------------------//
+
+    struct expression_reader
+    {
+	const module_loader* L = nullptr;
+
+	// Each builtin only needs to be looked up once.
+	map<string,expression_ref> builtins;
+
+	expression_ref read_builtin(const string& name, int n_args);
+
+	expression_ref read(istream& i);
+    };
+
+    expression_ref expression_reader::read_builtin(const string& name, int n_args)
+    {
+	auto record = builtins.find(name);
+	if (record != builtins.end())
+	    return record->second;
+
+	if (not L)
+	    throw myexception()<<"Module cache: can't load builtin '"<<name<<"' without a module loader.";
+
+	// See parse_builtin( ).
+	auto colon = name.find(':');
+	string plugin_name = name.substr(0, colon);
+	string symbol_name = name.substr(colon+1);
+	string filename = L->find_plugin(plugin_name);
+	expression_ref O = load_builtin_operation("builtin_function_" + symbol_name, filename, n_args, name);
+
+	builtins.insert({name, O});
+	return O;
+    }
+
+    expression_ref expression_reader::read(istream& i)
+    {
+	auto t = read_binary<tag>(i);
+	switch(t)
+	{
+	case tag::null:
+	    return {};
+	case tag::integer:
+	    return read_binary<int>(i);
+	case tag::real:
+	    return read_binary<double>(i);
+	case tag::log_real:
+	{
+	    log_double_t x;
+	    x.log() = read_binary<double>(i);
+	    return x;
+	}
+	case tag::character:
+	    return read_binary<char>(i);
+	case tag::index_var:
+	    return index_var(read_binary<int>(i));
+	case tag::expression:
+	{
+	    auto head = read(i);
+	    long n = read_binary<long>(i);
+	    vector<expression_ref> sub;
+	    sub.reserve(n);
+	    for(long k=0;k<n;k++)
+		sub.push_back(read(i));
+	    return expression_ref(head, sub);
+	}
+	case tag::var:
+	{
+	    string name = read_binary<string>(i);
+	    var x(read_binary<int>(i));
+	    x.name = name;
+	    x.work_dup = read_binary<amount_t>(i);
+	    x.code_dup = read_binary<amount_t>(i);
+	    x.context = read_binary<var_context>(i);
+	    x.is_loop_breaker = read_binary<bool>(i);
+	    x.top_level = read_binary<bool>(i);
+	    x.is_exported = read_binary<bool>(i);
+	    return x;
+	}
+	case tag::constructor:
+	{
+	    string name = read_binary<string>(i);
+	    constructor c(name, read_binary<int>(i));
+	    c.assoc = read_binary<assoc_type>(i);
+	    c.prec = read_binary<int>(i);
+	    return c;
+	}
+	case tag::ast_node:
+	{
+	    string type = read_binary<string>(i);
+	    string value = read_binary<string>(i);
+	    return AST_node(type, value);
+	}
+	case tag::string:
+	    return String(read_binary<string>(i));
+	case tag::lambda:
+	    return lambda();
+	case tag::lambda2:
+	    return lambda2();
+	case tag::let:
+	    return let_obj();
+	case tag::apply:
+	    return Apply();
+	case tag::case_:
+	    return Case();
+	case tag::let2:
+	    return Let();
+	case tag::modifiable:
+	    return modifiable();
+	case tag::operation:
+	{
+	    string name = read_binary<string>(i);
+	    int n_args = read_binary<int>(i);
+	    return read_builtin(name, n_args);
+	}
+	}
+	throw myexception()<<"Module cache file is corrupted: unknown tag "<<int(t)<<".";
+    }
+
+    symbol_info read_symbol_info(istream& i, expression_reader& reader)
+    {
+	symbol_info S;
+	S.name = read_binary<string>(i);
+	S.symbol_type = read_binary<symbol_type_t>(i);
+	S.arity = read_binary<int>(i);
+	S.precedence = read_binary<int>(i);
+	S.fixity = read_binary<fixity_t>(i);
+	S.type = reader.read(i);
+	return S;
+    }
+
+    map<string,symbol_info> read_symbols(istream& i, expression_reader& reader)
+    {
+	map<string,symbol_info> symbols;
+	long n = read_binary<long>(i);
+	for(long k=0;k<n;k++)
+	{
+	    string key = read_binary<string>(i);
+	    symbols.insert({key, read_symbol_info(i, reader)});
+	}
+	return symbols;
+    }
+
+    void write_header(ostream& o, const string& hash)
+    {
+	write_binary(o, cache_header);
+	write_binary(o, cache_version);
+	write_binary(o, hash);
+    }
+
+    // Check that the file was written by this version of the cache, for this hash.
+    void read_header(istream& i, const string& hash)
+    {
+	if (read_binary<string>(i) != cache_header)
+	    throw myexception()<<"Not a module cache file.";
+	if (read_binary<long>(i) != cache_version)
+	    throw myexception()<<"Module cache file has the wrong version.";
+	if (read_binary<string>(i) != hash)
+	    throw myexception()<<"Module cache file has the wrong hash.";
+    }
+
+    optional<string> read_file_if_exists(const fs::path& filename)
+    {
+	std::ifstream file(filename.string(), std::ios::binary);
+	if (not file)
+	    return boost::none;
+	std::ostringstream contents;
+	contents<<file.rdbuf();
+	return contents.str();
+    }
+}
+
+fs::path module_cache::cache_file(const string& hash, const string& extension) const
+{
+    return directory / (hash + extension);
+}
+
+void module_cache::write_file(const fs::path& filename, const string& contents) const
+{
+    // Other processes may be reading or writing the same file, so write a temporary file and then rename it.
+    auto temp_filename = directory / fs::unique_path("%%%%-%%%%-%%%%-%%%%.tmp");
+    {
+	std::ofstream file(temp_filename.string(), std::ios::binary | std::ios::trunc);
+	file.write(contents.data(), contents.size());
+	file.close();
+    }
+
+    boost::system::error_code ec;
+    if (fs::exists(temp_filename))
+	fs::rename(temp_filename, filename, ec);
+    if (ec or not fs::exists(filename))
+    {
+	fs::remove(temp_filename, ec);
+	throw myexception()<<"Failed to write module cache file '"<<filename.string()<<"'.";
+    }
+}
+
+string module_cache::source_hash(const string& file_contents) const
+{
+    return hash_string(compiler_id + "\n" + file_contents);
+}
+
+string module_cache::compiled_hash(const Module& M, const Program& P) const
+{
+    if (M.source_hash.empty()) return "";
+
+    std::ostringstream key;
+    key<<M.name<<"\n"<<M.source_hash<<"\n";
+    for(auto& name: M.dependencies())
+    {
+	auto& M2 = P.get_module(name);
+	if (M2.compiled_hash.empty()) return "";
+	key<<name<<" "<<M2.compiled_hash<<"\n";
+    }
+    return hash_string(key.str());
+}
+
+optional<expression_ref> module_cache::load_parsed(const string& source_hash) const
+{
+    auto contents = read_file_if_exists(cache_file(source_hash, ".parsed"));
+    if (not contents) return boost::none;
+
+    try
+    {
+	std::istringstream file(*contents);
+	read_header(file, source_hash);
+	expression_reader reader;
+	return reader.read(file);
+    }
+    // A corrupted file could also cause bad_alloc, etc.
+    catch (std::exception&)
+    {
+	return boost::none;
+    }
+}
+
+void module_cache::save_parsed(const string& source_hash, const expression_ref& parsed) const
+{
+    try
+    {
+	std::ostringstream file;
+	write_header(file, source_hash);
+	write_expression(file, parsed);
+	write_file(cache_file(source_hash, ".parsed"), file.str());
+    }
+    catch (std::exception&)
+    {
+	// Caching is just an optimization.
+    }
+}
+
+optional<Module> module_cache::load_compiled(const Module& M0, const module_loader& L) const
+{
+    if (M0.compiled_hash.empty()) return boost::none;
+
+    auto contents = read_file_if_exists(cache_file(M0.compiled_hash, ".module"));
+    if (not contents) return boost::none;
+
+    try
+    {
+	std::istringstream file(*contents);
+	read_header(file, M0.compiled_hash);
+
+	expression_reader reader;
+	reader.L = &L;
+
+	Module M(read_binary<string>(file));
+	if (M.name != M0.name)
+	    return boost::none;
+	M.source_hash = M0.source_hash;
+	M.compiled_hash = M0.compiled_hash;
+
+	M.symbols = read_symbols(file, reader);
+
+	long n_aliases = read_binary<long>(file);
+	for(long k=0;k<n_aliases;k++)
+	{
+	    string alias = read_binary<string>(file);
+	    M.aliases.insert({alias, read_binary<string>(file)});
+	}
+
+	M.exported_symbols_ = read_symbols(file, reader);
+
+	M.resolved = read_binary<bool>(file);
+	M.optimized = read_binary<bool>(file);
+	M.skip_desugaring = read_binary<bool>(file);
+	M.do_optimize = read_binary<bool>(file);
+
+	M.module = reader.read(file);
+	M.body = reader.read(file);
+	M.impdecls = reader.read(file);
+	M.topdecls = reader.read(file);
+	M.exports = reader.read(file);
+
+	long n_small_decls = read_binary<long>(file);
+	for(long k=0;k<n_small_decls;k++)
+	{
+	    auto x = reader.read(file);
+	    M.small_decls_out.insert({x.as_<var>(), reader.read(file)});
+	}
+
+	long n_free_vars = read_binary<long>(file);
+	for(long k=0;k<n_free_vars;k++)
+	    M.small_decls_out_free_vars.insert(reader.read(file).as_<var>());
+
+	return M;
+    }
+    // A corrupted file could also cause bad_alloc, etc.
+    catch (std::exception&)
+    {
+	return boost::none;
+    }
+}
+
+// The small_decls_in are not saved: they are only used while optimizing the module.
+void module_cache::save_compiled(const Module& M) const
+{
+    if (M.compiled_hash.empty()) return;
+
+    try
+    {
+	std::ostringstream file;
+	write_header(file, M.compiled_hash);
+
+	write_binary(file, M.name);
+
+	write_symbols(file, M.symbols);
+
+	write_binary<long>(file, M.aliases.size());
+	for(auto& alias: M.aliases)
+	{
+	    write_binary(file, alias.first);
+	    write_binary(file, alias.second);
+	}
+
+	write_symbols(file, M.exported_symbols_);
+
+	write_binary(file, M.resolved);
+	write_binary(file, M.optimized);
+	write_binary(file, M.skip_desugaring);
+	write_binary(file, M.do_optimize);
+
+	write_expression(file, M.module);
+	write_expression(file, M.body);
+	write_expression(file, M.impdecls);
+	write_expression(file, M.topdecls);
+	write_expression(file, M.exports);
+
+	write_binary<long>(file, M.small_decls_out.size());
+	for(auto& decl: M.small_decls_out)
+	{
+	    write_expression(file, decl.first);
+	    write_expression(file, decl.second);
+	}
+
+	write_binary<long>(file, M.small_decls_out_free_vars.size());
+	for(auto& x: M.small_decls_out_free_vars)
+	    write_expression(file, x);
+
+	write_file(cache_file(M.compiled_hash, ".module"), file.str());
+    }
+    catch (std::exception&)
+    {
+	// Caching is just an optimization.
+    }
+}
+
+module_cache::module_cache(const fs::path& d, const string& id)
+    :directory(d), compiler_id(id)
+{
+    boost::system::error_code ec;
+    fs::create_directories(directory, ec);
+    if (not fs::is_directory(directory))
+	throw myexception()<<"Can't create module cache directory '"<<directory.string()<<"'.";
+}
+
+string executable_id(const fs::path& exe)
+{
+    std::ostringstream id;
+    id<<fs::canonical(exe).string()<<" "<<fs::file_size(exe)<<" "<<fs::last_write_time(exe);
+    return id.str();
+}
@@ -130,7 +130,7 @@ closure apply_op(OperationArgs& Args)
 
 closure case_op(OperationArgs& Args)
 {
-    extern long total_case_op;
+    extern thread_local long total_case_op;
     total_case_op++;
 
     // Resizing of the memory can occur here, invalidating previously computed pointers
@@ -250,7 +250,7 @@ closure case_op(OperationArgs& Args)
 
 closure let_op(OperationArgs& Args)
 {
-    extern long total_let_op;
+    extern thread_local long total_let_op;
     total_let_op++;
 
     reg_heap& M = Args.memory();
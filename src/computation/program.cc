@@ -160,7 +160,22 @@ void Program::compile(int i)
 
     auto& M = modules()[i];
     try {
+	// Use the compiled module from the cache if it was compiled from the same source and imports.
+	auto& cache = loader->cache;
+	if (cache)
+	{
+	    M.compiled_hash = cache->compiled_hash(M, *this);
+	    if (auto compiled = cache->load_compiled(M, *loader))
+	    {
+		M = *compiled;
+		return;
+	    }
+	}
+
 	M.compile(*this);
+
+	if (cache)
+	    cache->save_compiled(M);
     }
     catch (myexception& e)
     {
@@ -32,6 +32,7 @@
 #include "util.H"
 #include "alignment/alignment-constraint.H"
 #include "math/logprod.H"
+#include "util/thread-pool.H"
 
 using std::vector;
 using std::valarray;
@@ -40,6 +41,10 @@ using std::endl;
 using std::isfinite;
 using std::pair;
 
+/// The size of the tiles that forward_band( ) computes in parallel.
+constexpr int wavefront_tile_rows = 64;
+constexpr int wavefront_tile_columns = 64;
+
 void state_matrix::clear() 
 {
     delete[] data; 
@@ -47,6 +52,30 @@ void state_matrix::clear()
   
     delete[] scale_; 
     scale_ = NULL;
+
+    std::fill(row_first.begin(), row_first.end(), 0);
+    std::fill(row_offset.begin(), row_offset.end(), 0);
+}
+
+void state_matrix::allocate_band(const vector< pair<int,int> >& columns)
+{
+    assert(columns.size() == s1);
+
+    clear();
+
+    for(int i=0;i<s1;i++)
+    {
+	int first = columns[i].first;
+	int last = columns[i].second;
+	assert(0 <= first and last < s2);
+	int length = std::max(last - first + 1, 0);
+
+	row_first[i] = first;
+	row_offset[i+1] = row_offset[i] + length;
+    }
+
+    data = new double[std::size_t(n_cells())*s3];
+    scale_ = new int[n_cells()];
 }
 
 state_matrix::~state_matrix() 
@@ -130,6 +159,19 @@ void DPmatrix::forward_band(const vector< pair<int,int> >& yboundaries)
     assert(yboundaries[0].first == 0);
     assert(yboundaries.back().second == J - 1);
 
+    // Allocate the cells that we compute below, and the cleared cells that border them.
+    {
+	vector< pair<int,int> > columns(I+1);
+	columns[0] = {1 + yboundaries[0].first, 1 + yboundaries[0].second};
+	for(int x=x1;x<=x2;x++)
+	{
+	    columns[x] = {yboundaries[x-1].first, 1 + yboundaries[x-1].second};
+	    if (x < x2)
+		columns[x].second = max(columns[x].second, 1 + yboundaries[x].second);
+	}
+	allocate_band(columns);
+    }
+
     // Since we are using M(0,0) instead of S(0,0), we need to run only the silent states at (0,0)
     // We can only use non-silent states at (0,0) to simulate S
 
@@ -142,18 +184,10 @@ void DPmatrix::forward_band(const vector< pair<int,int> >& yboundaries)
 	    clear_cell(x1-1,y);
     }
 
-    // forward first row, with exception for S(0,0): x = 0
-    {
-	int y1 = 1 + yboundaries[0].first;
-	int y2 = 1 + yboundaries[0].second;
-	assert(y1 <= y2);
-	clear_cell(x1,y1-1);
-	forward_first_cell(x1,y1);
-	for(int y=y1+1;y<=y2;y++)
-	    forward_cell(x1,y);
-    }
+    // clear the untouched empty cell below the first row: x = 0
+    clear_cell(x1,yboundaries[0].first);
 
-    // forward other rows: x = 1...I-1
+    // clear the untouched empty cells next to the other rows: x = 1...I-1
     for(int x=x1+1;x<=x2;x++) 
     {
 	int y1 = 1 + yboundaries[x-1].first;
@@ -170,15 +204,87 @@ void DPmatrix::forward_band(const vector< pair<int,int> >& yboundaries)
 
 	// clear the untouched empty cell below us
 	clear_cell(x,y1-1);
-
-	// compute the untouched cells in this row
-	for(int y=y1;y<=y2;y++)
-	    forward_cell(x,y);
     }
 
+    // The cleared cells are not computed, so they can be cleared first, and the
+    // computed cells can be filled in any order that respects their dependencies.
+    if (n_threads() > 1 and n_cells() >= 4*wavefront_tile_rows*wavefront_tile_columns)
+	forward_band_wavefront(yboundaries);
+    else
+	for(int x=x1;x<=x2;x++)
+	    forward_row(x, 1 + yboundaries[x-1].first, 1 + yboundaries[x-1].second);
+
     compute_Pr_sum_all_paths();
 }
 
+/// Compute the cells (x,y) with y1 <= y <= y2, in order.
+void DPmatrix::forward_row(int x, int y1, int y2)
+{
+    if (y1 > y2) return;
+
+    // forward first row, with exception for S(0,0): x = 0
+    if (x == 1 and y1 == 1)
+    {
+	forward_first_cell(x,y1);
+	y1++;
+    }
+
+    for(int y=y1;y<=y2;y++)
+	forward_cell(x,y);
+}
+
+// Each cell depends only on the cells above it, to its left, and diagonally above and to
+// the left.  So we divide the band into tiles, and compute the tiles on each anti-diagonal
+// at the same time, after the tiles on the previous anti-diagonal are done.  Each cell is
+// computed exactly as in a serial pass, so the results do not depend on the number of threads.
+void DPmatrix::forward_band_wavefront(const vector< pair<int,int> >& yboundaries)
+{
+    const int I = size1()-1;
+
+    // The rows are x = 1...I, and row x contains the columns y1(x)...y2(x).
+    auto y1 = [&](int x) {return 1 + yboundaries[x-1].first;};
+    auto y2 = [&](int x) {return 1 + yboundaries[x-1].second;};
+
+    // Tile (a,b) contains rows 1 + a*R ... and columns b*C ...
+    const int R = wavefront_tile_rows;
+    const int C = wavefront_tile_columns;
+    const int n_row_tiles = (I + R - 1)/R;
+
+    // The boundaries are non-decreasing, so the tiles in each row of tiles are consecutive.
+    vector<pair<int,int>> column_tiles(n_row_tiles);
+    for(int a=0;a<n_row_tiles;a++)
+    {
+	int xa1 = 1 + a*R;
+	int xa2 = std::min(I, xa1 + R - 1);
+	column_tiles[a] = {y1(xa1)/C, y2(xa2)/C};
+    }
+
+    const int first_diagonal = column_tiles[0].first;
+    const int last_diagonal = (n_row_tiles - 1) + column_tiles.back().second;
+
+    vector<pair<int,int>> tiles;
+    for(int d=first_diagonal;d<=last_diagonal;d++)
+    {
+	tiles.clear();
+	for(int a=0;a<n_row_tiles;a++)
+	{
+	    int b = d - a;
+	    if (column_tiles[a].first <= b and b <= column_tiles[a].second)
+		tiles.push_back({a,b});
+	}
+
+	worker_pool().parallel_for(tiles.size(), [&](int k)
+				   {
+				       int a = tiles[k].first;
+				       int b = tiles[k].second;
+				       int xa1 = 1 + a*R;
+				       int xa2 = std::min(I, xa1 + R - 1);
+				       for(int x=xa1;x<=xa2;x++)
+					   forward_row(x, std::max(y1(x), b*C), std::min(y2(x), (b+1)*C - 1));
+				   });
+    }
+}
+
 void DPmatrix::compute_Pr_sum_all_paths()
 {
     const int I = size1()-1;
@@ -188,7 +294,7 @@ void DPmatrix::compute_Pr_sum_all_paths()
     for(int state1=0;state1<n_dp_states();state1++)
 	total += (*this)(I,J,state1)*GQ(state1,endstate());
 
-    Pr_total *= pow(log_double_t(2.0),scale(I,J)) * total;
+    Pr_total = Pr_extra_subst * (pow(log_double_t(2.0),scale(I,J)) * total);
     assert(not std::isnan(log(Pr_total)) and isfinite(log(Pr_total)));
 
     // This really is a probability, so it should be <= 1
@@ -315,20 +421,31 @@ DPmatrix::DPmatrix(int i1,
     :DPengine(M),
      state_matrix(i1,i2,n_dp_states())
 {
-    const int I = size1()-1;
-    const int J = size2()-1;
-
-    for(int state1=0;state1<n_dp_states();state1++)
-	(*this)(I,J,state1) = 0;
 }
 
 inline double sum(const valarray<double>& v) {
     return v.sum();
 }
 
-// switching dists1[] to matrices actually made things WORSE!
-inline double DPmatrixEmit::emitMM(int i,int j) const {
-    return s12_sub(i,j);
+// We compute this on the fly instead of storing it for every cell, since
+// the forward algorithm uses each value only once.
+inline double DPmatrixEmit::emitMM(int i,int j) const 
+{
+    assert(i > 0);
+    assert(j > 0);
+  
+    const double* __restrict__ m1 = dists1[i];
+    const double* __restrict__ m2 = dists2[j];
+
+    double total=0;
+    const int MS = dists1.matrix_size();
+    for(int t=0;t<MS;t++)
+	total += m1[t] * m2[t];
+
+    if (B != 1.0)
+	total = pow(total,B);
+
+    return total;
 }
 
 log_double_t DPmatrixEmit::path_Q_subst(const vector<int>& path) const 
@@ -350,31 +467,11 @@ log_double_t DPmatrixEmit::path_Q_subst(const vector<int>& path) const
     return P_sub * Pr_extra_subst;
 }
 
-void DPmatrixEmit::prepare_cell(int i,int j) 
-{
-    assert(i > 0);
-    assert(j > 0);
-  
-    double* __restrict__ m1 = dists1[i];
-    double* __restrict__ m2 = dists2[j];
-
-    double total=0;
-    const int MS = dists1.matrix_size();
-    for(int t=0;t<MS;t++)
-	total += m1[t] * m2[t];
-
-    if (B != 1.0)
-	total = pow(total,B);
-
-    s12_sub(i,j) = total;
-}
-
 DPmatrixEmit::DPmatrixEmit(const HMM& M,
 			   EmissionProbs&& d1,
 			   EmissionProbs&& d2,
 			   const Matrix& weighted_frequencies)
     :DPmatrix(d1.n_columns(), d2.n_columns(), M),
-     s12_sub(d1.n_columns(), d2.n_columns()),
      dists1(std::move(d1)), dists2(std::move(d2))
 {
     //----- cache G1,G2 emission probabilities -----//
@@ -423,7 +520,7 @@ void DPmatrixSimple::forward_cell(int i2,int j2)
     assert(0 < i2 and i2 < size1());
     assert(0 < j2 and j2 < size2());
 
-    prepare_cell(i2,j2);
+    const double emit = emitMM(i2,j2);
 
     // determine initial scale for this cell
     scale(i2,j2) = max(scale(i2-1,j2), max( scale(i2-1,j2-1), scale(i2,j2-1) ) );
@@ -451,10 +548,11 @@ void DPmatrixSimple::forward_cell(int i2,int j2)
 
 	//--- Include Emission Probability----
 	if (i1 != i2 and j1 != j2)
-	    temp *= emitMM(i2,j2);
+	    temp *= emit;
 
 	// rescale result to scale of this cell
-	if (scale(i1,j1) != scale(i2,j2))
+	// (skip cleared cells: their scale is INT_MIN, and the difference could overflow)
+	if (temp > 0 and scale(i1,j1) != scale(i2,j2))
 	    temp *= pow2(scale(i1,j1)-scale(i2,j2));
 
 	// record maximum
@@ -491,7 +589,7 @@ inline void DPmatrixConstrained::forward_cell(int i2,int j2)
     assert(0 < i2 and i2 < size1());
     assert(0 < j2 and j2 < size2());
 
-    prepare_cell(i2,j2);
+    const double emit = emitMM(i2,j2);
 
     // determine initial scale for this cell
     scale(i2,j2) = max(scale(i2-1,j2), max( scale(i2-1,j2-1), scale(i2,j2-1) ) );
@@ -522,10 +620,11 @@ inline void DPmatrixConstrained::forward_cell(int i2,int j2)
 
 	//--- Include Emission Probability----
 	if (i1 != i2 and j1 != j2)
-	    temp *= emitMM(i2,j2);
+	    temp *= emit;
 
 	// rescale result to scale of this cell
-	if (scale(i1,j1) != scale(i2,j2))
+	// (skip cleared cells: their scale is INT_MIN, and the difference could overflow)
+	if (temp > 0 and scale(i1,j1) != scale(i2,j2))
 	    temp *= pow2(scale(i1,j1)-scale(i2,j2));
 
 	// record maximum
@@ -559,7 +658,7 @@ void DPmatrixConstrained::compute_Pr_sum_all_paths()
 	total += (*this)(I,J,S1)*GQ(S1,endstate());
     }
 
-    Pr_total *= pow(log_double_t(2.0),scale(I,J)) * total;
+    Pr_total = Pr_extra_subst * (pow(log_double_t(2.0),scale(I,J)) * total);
     assert(not std::isnan(log(Pr_total)) and isfinite(log(Pr_total)));
 
     // This really is a probability, so it should be <= 1
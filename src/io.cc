@@ -188,8 +188,8 @@ checked_filebuf * checked_filebuf::open ( const std::string& filename, std::ios_
   bool is_dir = fs::is_directory(filename);
   std::filebuf* buf = 0;
 
-  // open the file if either we're not going to overwrite it, or we're opening the truncate flag
-  if (!is_dir and (!already_existed or not (mode&ios_base::out) or (mode&ios_base::trunc)))
+  // open the file if either we're not going to overwrite it, or we're opening the truncate or append flag
+  if (!is_dir and (!already_existed or not (mode&ios_base::out) or (mode&ios_base::trunc) or (mode&ios_base::app)))
       buf = std::filebuf::open(filename.c_str(), mode);
 
   if (!buf)
@@ -270,6 +270,13 @@ checked_ofstream::checked_ofstream(const string& filename,bool trunc)
   buf.open(filename, flags);
 }
 
+checked_ofstream::checked_ofstream(const string& filename, ios_base::openmode mode)
+  :buf("file")
+{
+  this->init(&buf);
+  buf.open(filename, mode|ios_base::out);
+}
+
 checked_ofstream::checked_ofstream(const string& filename, const string& description, bool trunc)
   :buf(description)
 {
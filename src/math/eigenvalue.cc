@@ -18,6 +18,9 @@ along with BAli-Phy; see the file COPYING.  If not see
 <http://www.gnu.org/licenses/>.  */
 
 #include "math/eigenvalue.H"
+#include "util/lru-cache.H"
+#include <cstring>
+#include <cstdint>
 #include <Eigen/Eigenvalues>
 #include <Eigen/Dense>
 
@@ -48,3 +51,59 @@ EigenValues::EigenValues(const Matrix& M)
       O(i,j) = o(i,j);
 }
 
+
+namespace
+{
+  /// The entries of S followed by the entries of pi.
+  typedef std::vector<double> eigensystem_key;
+
+  struct hash_eigensystem_key
+  {
+    std::size_t operator()(const eigensystem_key& key) const
+    {
+      // FNV-1a over the bits of the entries.
+      std::uint64_t h = 14695981039346656037ULL;
+      for(double x: key)
+      {
+        std::uint64_t bits;
+        std::memcpy(&bits, &x, sizeof(bits));
+        h = (h ^ bits) * 1099511628211ULL;
+      }
+      return h;
+    }
+  };
+
+  /// Codon models need about 60KB per eigensystem.
+  constexpr std::size_t eigensystem_cache_bytes = 8*1024*1024;
+
+  typedef lru_cache<eigensystem_key, object_ptr<const EigenValues>, hash_eigensystem_key> eigensystem_cache_t;
+
+  // Reference counts are not atomic, so objects from the cache must not be shared between
+  // models that run in different threads.  Therefore each thread has its own cache.
+  eigensystem_cache_t& eigensystem_cache()
+  {
+    static thread_local eigensystem_cache_t cache(eigensystem_cache_bytes);
+    return cache;
+  }
+}
+
+void clear_eigensystem_cache()
+{
+  eigensystem_cache().clear();
+}
+
+object_ptr<const EigenValues> cached_eigensystem(const Matrix& S, const std::vector<double>& pi)
+{
+  auto& cache = eigensystem_cache();
+
+  eigensystem_key key(S.begin(), S.end());
+  key.insert(key.end(), pi.begin(), pi.end());
+
+  object_ptr<const EigenValues> L;
+  if (not cache.find(key, L))
+  {
+    L = new EigenValues(S);
+    cache.insert(key, L, 2*key.size()*sizeof(double));
+  }
+  return L;
+}
@@ -24,8 +24,13 @@
 ///
 
 #include <vector>
+#include <algorithm>
+#include <functional>
+#include <cmath>
 #include "math/exponential.H"
 #include "math/eigenvalue.H"
+#include "util/lru-cache.H"
+#include <Eigen/Dense>
 
 
 // The approach used in this file works because of general properties
@@ -64,43 +69,88 @@
 
 using std::vector;
 
-// compute the exp(M) - I from the SVD for M (i.e. M=O D O^t )
-Matrix expm1(const EigenValues& solution,double t) 
+typedef Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> RowMatrix;
+
+/// Compute expm1(t*D[l]) for each t in times and each eigenvalue D[l], in a single pass.
+vector<double> expm1_eigenvalues(const vector<double>& D, const vector<double>& times)
+{
+    const int n = D.size();
+    const int K = times.size();
+    vector<double> e(K*n);
+    for(int k=0;k<K;k++)
+	for(int l=0;l<n;l++)
+	    e[k*n + l] = std::expm1(times[k]*D[l]);
+    return e;
+}
+
+// Compute exp(M) - I from the SVD for M (i.e. M=O D O^t ), for M = S*t and each t in times.
+//
+// We compute O * [expm1(t1*D) O^t | expm1(t2*D) O^t | ... ] as a single matrix product.
+// The result for t[k] is in columns [k*n, (k+1)*n).
+RowMatrix expm1(const EigenValues& solution, const vector<double>& times)
 {
-    const Matrix& O = solution.Rotation();
-    std::vector<double> D = solution.Diagonal();
-
-    // Exponentiate Eigenvalues
-    for(int i=0;i<solution.size();i++)
-	D[i] = expm1(t*D[i]);
-
-    //Matrix E = prod(O,prod(D,trans(O)));
-
-    int size = O.size1();
-    Matrix E(size,size);
-    for(int i=0;i<size;i++)
-	for(int j=0;j<size;j++) {
-	    double temp =0;
-	    for(int k=0;k<size;k++)
-		temp += O(i,k)*O(j,k)*D[k];
-	    E(i,j) = temp;
+    const int n = solution.size();
+    const int K = times.size();
+    Eigen::Map<const RowMatrix> O(solution.Rotation().begin(), n, n);
+
+    auto e = expm1_eigenvalues(solution.Diagonal(), times);
+
+    RowMatrix B(n, K*n);
+    for(int k=0;k<K;k++)
+	for(int l=0;l<n;l++)
+	{
+	    double d = e[k*n + l];
+	    for(int j=0;j<n;j++)
+		B(l, k*n + j) = d * O(j,l);
 	}
-	
+
+    RowMatrix E = O * B;
+
 #ifndef NDEBUG
-    for(int i=0;i<E.size1();i++)
-	for(int j=0;j<E.size2();j++)
-	    assert(E(i,j) + ((i==j)?1.0:0.0) >= -1.0e-13);
+    for(int i=0;i<n;i++)
+	for(int j=0;j<K*n;j++)
+	    assert(E(i,j) + ((i==j%n)?1.0:0.0) >= -1.0e-13);
 #endif
-
     return E;
 }
 
-/// Compute the exponential of a matrix from a reversible markov chain
-Matrix exp(const EigenValues& eigensystem, const vector<double>& pi, const double t)
+// Compute P = I + PI^-0.5 * E * PI^0.5, reading only the lower triangle of the symmetric matrix E.
+//
+// Since E(i,j) = E(j,i), each entry below the diagonal gives us both P(i,j) and P(j,i).
+template <typename M>
+void scale_symmetric(const M& E, const vector<double>& DP, const vector<double>& DN, Matrix& P)
 {
-    Matrix E = expm1(eigensystem,t);
+    const int n = DP.size();
+    P.resize(n,n);
+    for(int i=0;i<n;i++)
+    {
+	for(int j=0;j<i;j++)
+	{
+	    double e = E(i,j);
+	    double x1 = e * DN[i]*DP[j];
+	    double x2 = e * DN[j]*DP[i];
+	    assert(x1 >= -1.0e-13 and x2 >= -1.0e-13);
+	    P(i,j) = std::max(x1, 0.0);
+	    P(j,i) = std::max(x2, 0.0);
+	}
+	double x = 1.0 + E(i,i);
+	assert(x >= -1.0e-13);
+	P(i,i) = std::max(x, 0.0);
+    }
+}
+
+// For small matrices, one big product beats anything fancier.
+constexpr int min_symmetric_states = 16;
 
+/// Compute the exponential of a matrix from a reversible markov chain, for each t in times
+///
+/// For larger matrices, we write O expm1(tD) O^t as -W W^t (plus a correction for any positive
+/// entries of expm1(tD)), where W = O |expm1(tD)|^0.5.  This lets us compute only one triangle
+/// of each symmetric product, which takes half as many operations as the general product.
+vector<Matrix> exp(const EigenValues& eigensystem, const vector<double>& pi, const vector<double>& times)
+{
     const int n = pi.size();
+    const int K = times.size();
 
     std::vector<double> DP(n);
     std::vector<double> DN(n);
@@ -109,19 +159,153 @@ Matrix exp(const EigenValues& eigensystem, const vector<double>& pi, const doubl
 	DN[i] = 1.0/DP[i];
     }
 
-    for(int i=0;i<E.size1();i++)
-	for(int j=0;j<E.size2();j++)
-	    E(i,j) *= DN[i]*DP[j];
+    vector<Matrix> P(K);
+
+    if (n < min_symmetric_states)
+    {
+	RowMatrix E = expm1(eigensystem, times);
+	for(int k=0;k<K;k++)
+	    scale_symmetric(E.middleCols(k*n, n), DP, DN, P[k]);
+	return P;
+    }
+
+    Eigen::Map<const RowMatrix> O(eigensystem.Rotation().begin(), n, n);
 
-    for(int i=0;i<E.size1();i++)
-	E(i,i) += 1.0;
+    auto e = expm1_eigenvalues(eigensystem.Diagonal(), times);
 
-    for(int i=0;i<E.size1();i++)
-	for(int j=0;j<E.size2();j++) {
-	    assert(E(i,j) >= -1.0e-13);
-	    if (E(i,j)<0)
-		E(i,j)=0;
+    // Reuse the same storage for each t.
+    Eigen::MatrixXd W_neg(n, n);
+    Eigen::MatrixXd W_pos(n, n);
+    Eigen::MatrixXd E(n, n);
+    for(int k=0;k<K;k++)
+    {
+	// Since the eigenvalues of a rate matrix are <= 0, W_pos is almost always empty.
+	int n_neg = 0;
+	int n_pos = 0;
+	for(int l=0;l<n;l++)
+	{
+	    double d = e[k*n + l];
+	    if (d < 0)
+		W_neg.col(n_neg++) = O.col(l) * std::sqrt(-d);
+	    else if (d > 0)
+		W_pos.col(n_pos++) = O.col(l) * std::sqrt(d);
 	}
 
-    return E;
+	auto Wn = W_neg.leftCols(n_neg);
+	auto Wp = W_pos.leftCols(n_pos);
+
+	E.triangularView<Eigen::Lower>() = -Wn * Wn.transpose();
+	if (n_pos > 0)
+	    E.triangularView<Eigen::Lower>() += Wp * Wp.transpose();
+
+	scale_symmetric(E, DP, DN, P[k]);
+    }
+
+    return P;
+}
+
+/// Compute the exponential of a matrix from a reversible markov chain
+Matrix exp(const EigenValues& eigensystem, const vector<double>& pi, const double t)
+{
+    return std::move(exp(eigensystem, pi, vector<double>{t})[0]);
+}
+
+namespace
+{
+    struct transition_key
+    {
+	// Holding a reference keeps the address from being reused for a different eigensystem.
+	object_ptr<const EigenValues> eigensystem;
+	double t;
+
+	bool operator==(const transition_key& k) const {return eigensystem == k.eigensystem and t == k.t;}
+    };
+
+    struct hash_transition_key
+    {
+	std::size_t operator()(const transition_key& k) const
+	{
+	    return std::hash<const EigenValues*>()(k.eigensystem.get()) ^ (std::hash<double>()(k.t) * 31);
+	}
+    };
+
+    /// Room for a few thousand codon matrices, or many more nucleotide matrices.
+    constexpr std::size_t transition_cache_bytes = 64*1024*1024;
+
+    typedef lru_cache<transition_key, object_ptr<const Box<Matrix>>, hash_transition_key> transition_cache_t;
+
+    // Like the eigensystem cache, each thread has its own cache.
+    transition_cache_t& transition_cache()
+    {
+	static thread_local transition_cache_t cache(transition_cache_bytes);
+	return cache;
+    }
+}
+
+void clear_transition_cache()
+{
+    transition_cache().clear();
+}
+
+vector<object_ptr<const Box<Matrix>>> cached_exp(const vector<object_ptr<const EigenValues>>& eigensystems,
+						 const vector<const vector<double>*>& pi,
+						 const vector<double>& times)
+{
+    auto& cache = transition_cache();
+
+    const int K = times.size();
+    assert(eigensystems.size() == K);
+    assert(pi.size() == K);
+
+    vector<object_ptr<const Box<Matrix>>> P(K);
+
+    // Collect the matrices that we need to compute for each eigensystem.
+    vector<const EigenValues*> groups;
+    vector<vector<int>> group_members;
+    for(int k=0;k<K;k++)
+    {
+	if (cache.find({eigensystems[k], times[k]}, P[k])) continue;
+
+	int g = std::find(groups.begin(), groups.end(), eigensystems[k].get()) - groups.begin();
+	if (g == groups.size())
+	{
+	    groups.push_back(eigensystems[k].get());
+	    group_members.push_back({});
+	}
+	// The same branch length may occur more than once.
+	auto& members = group_members[g];
+	if (std::none_of(members.begin(), members.end(), [&](int k2) {return times[k2] == times[k];}))
+	    members.push_back(k);
+    }
+
+    for(int g=0;g<groups.size();g++)
+    {
+	const auto& members = group_members[g];
+
+	vector<double> group_times;
+	for(int k: members)
+	    group_times.push_back(times[k]);
+
+	auto group_P = exp(*groups[g], *pi[members[0]], group_times);
+
+	for(int i=0;i<members.size();i++)
+	{
+	    int k = members[i];
+	    const int n = group_P[i].size1();
+	    P[k] = new Box<Matrix>(std::move(group_P[i]));
+	    cache.insert({eigensystems[k], times[k]}, P[k], n*n*sizeof(double));
+	}
+    }
+
+    // Fill in branch lengths that occurred more than once.
+    for(int k=0;k<K;k++)
+	if (not P[k])
+	    for(int k2=0;k2<K;k2++)
+		if (P[k2] and eigensystems[k2] == eigensystems[k] and times[k2] == times[k])
+		{
+		    P[k] = P[k2];
+		    break;
+		}
+
+    return P;
 }
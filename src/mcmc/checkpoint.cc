@@ -0,0 +1,391 @@
+/*
+  Copyright (C) 2018 Benjamin Redelings
+
+  This file is part of BAli-Phy.
+
+  BAli-Phy is free software; you can redistribute it and/or modify it under
+  the terms of the GNU General Public License as published by the Free
+  Software Foundation; either version 2, or (at your option) any later
+  version.
+
+  BAli-Phy is distributed in the hope that it will be useful, but WITHOUT ANY
+  WARRANTY; without even the implied warranty of MERCHANTABILITY or
+  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+  for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with BAli-Phy; see the file COPYING.  If not see
+  <http://www.gnu.org/licenses/>.  */
+
+///
+/// \file   checkpoint.cc
+/// \brief  Reading and writing the binary checkpoint files used to resume MCMC runs.
+///
+/// A checkpoint file contains, in order:
+///   - a header and the iteration at which the run should resume
+///   - the size of each output file at that iteration
+///   - the state of the random number generator
+///   - the values of the modifiable parameters (which include the tree and the
+///     pairwise alignments) and of the random variables (which include the
+///     branch lengths)
+///   - the step sizes and other state learned by the moves
+///   - the move statistics
+///
+
+#include <fstream>
+#include <boost/filesystem.hpp>
+
+#include "mcmc/checkpoint.H"
+#include "mcmc/mcmc.H"
+#include "models/parameters.H"
+#include "dp/2way.H"
+#include "computation/expression/constructor.H"
+#include "util/async-writer.H"
+#include "rng.H"
+
+namespace fs = boost::filesystem;
+
+using std::string;
+using std::vector;
+using std::ostream;
+using std::istream;
+
+namespace MCMC {
+
+    namespace
+    {
+	const string checkpoint_header = "BAli-Phy checkpoint";
+
+	// Increase this when the format changes.
+	const long checkpoint_version = 1;
+
+	enum class value_type: char {integer, real, log_real, character, constant, pairwise_alignment};
+
+	value_type type_of_value(const expression_ref& v)
+	{
+	    if (v.is_int())
+		return value_type::integer;
+	    else if (v.is_double())
+		return value_type::real;
+	    else if (v.is_log_double())
+		return value_type::log_real;
+	    else if (v.is_char())
+		return value_type::character;
+	    else if (v.is_a<pairwise_alignment_t>())
+		return value_type::pairwise_alignment;
+	    else if (v.is_a<constructor>() and v.as_<constructor>().n_args() == 0)
+		return value_type::constant;
+	    else
+		throw myexception()<<"Cannot write value '"<<v<<"' to a checkpoint.";
+	}
+
+	void write_value(ostream& o, const expression_ref& v)
+	{
+	    auto type = type_of_value(v);
+	    write_binary(o, type);
+
+	    switch(type)
+	    {
+	    case value_type::integer:
+		write_binary(o, v.as_int());
+		break;
+	    case value_type::real:
+		write_binary(o, v.as_double());
+		break;
+	    case value_type::log_real:
+		write_binary(o, v.as_log_double().log());
+		break;
+	    case value_type::character:
+		write_binary(o, v.as_char());
+		break;
+	    case value_type::constant:
+		write_binary(o, v.as_<constructor>().f_name);
+		break;
+	    case value_type::pairwise_alignment:
+	    {
+		auto& A = v.as_<pairwise_alignment_t>();
+		string states(A.size(), ' ');
+		for(int i=0;i<A.size();i++)
+		    states[i] = A.get_state(i);
+		write_binary(o, states);
+		break;
+	    }
+	    }
+	}
+
+	expression_ref read_value(istream& i)
+	{
+	    auto type = read_binary<value_type>(i);
+
+	    switch(type)
+	    {
+	    case value_type::integer:
+		return read_binary<int>(i);
+	    case value_type::real:
+		return read_binary<double>(i);
+	    case value_type::log_real:
+	    {
+		log_double_t x;
+		x.log() = read_binary<double>(i);
+		return x;
+	    }
+	    case value_type::character:
+		return read_binary<char>(i);
+	    case value_type::constant:
+		return new constructor(read_binary<string>(i), 0);
+	    case value_type::pairwise_alignment:
+	    {
+		string states = read_binary<string>(i);
+		object_ptr<pairwise_alignment_t> A(new pairwise_alignment_t);
+		A->resize(states.size());
+		for(int j=0;j<states.size();j++)
+		    A->set_state(j, states[j]);
+		return A;
+	    }
+	    }
+	    throw myexception()<<"Checkpoint file is corrupted: unknown value type "<<int(type)<<".";
+	}
+
+	void write_move_stats(ostream& o, const MoveStats& Stats)
+	{
+	    write_binary<long>(o, Stats.size());
+	    for(auto& entry: Stats)
+	    {
+		auto& R = entry.second;
+		write_binary(o, entry.first);
+		write_binary<long>(o, R.size());
+		for(int j=0;j<R.size();j++)
+		{
+		    write_binary(o, R.counts[j]);
+		    write_binary(o, R.totals[j]);
+		}
+	    }
+	}
+
+	void read_move_stats(istream& i, MoveStats& Stats)
+	{
+	    Stats.clear();
+	    long n = read_binary<long>(i);
+	    for(long k=0;k<n;k++)
+	    {
+		string name = read_binary<string>(i);
+		int size = read_binary<long>(i);
+		Result R(size);
+		for(int j=0;j<size;j++)
+		{
+		    R.counts[j] = read_binary<int>(i);
+		    R.totals[j] = read_binary<double>(i);
+		}
+		Stats[name] = R;
+	    }
+	}
+
+	/// Read the header, and return the iteration that the checkpoint was written at.
+	long read_header(istream& i, const string& filename)
+	{
+	    string header;
+	    try
+	    {
+		header = read_binary<string>(i);
+	    }
+	    catch (myexception&)
+	    { }
+
+	    if (header != checkpoint_header)
+		throw myexception()<<"'"<<filename<<"' is not a BAli-Phy checkpoint file.";
+
+	    long version = read_binary<long>(i);
+	    if (version != checkpoint_version)
+		throw myexception()<<"Checkpoint '"<<filename<<"' has version "<<version<<", but this version of BAli-Phy reads version "<<checkpoint_version<<".";
+
+	    return read_binary<long>(i);
+	}
+
+	/// The output file names are stored relative to the directory of the checkpoint.
+	vector<std::pair<string,long>> read_output_file_sizes(istream& i)
+	{
+	    vector<std::pair<string,long>> sizes;
+	    long n = read_binary<long>(i);
+	    for(long k=0;k<n;k++)
+	    {
+		string name = read_binary<string>(i);
+		long size = read_binary<long>(i);
+		sizes.push_back({name,size});
+	    }
+	    return sizes;
+	}
+
+	std::ifstream open_checkpoint(const string& filename)
+	{
+	    std::ifstream file(filename, std::ios::binary);
+	    if (not file)
+		throw myexception()<<"Can't open checkpoint file '"<<filename<<"'.";
+	    return file;
+	}
+    }
+
+    void write_model_state(ostream& o, const Model& M)
+    {
+	// 1. The parameters.  Only modifiable parameters hold state.
+	write_binary<long>(o, M.n_parameters());
+	for(int p=0;p<M.n_parameters();p++)
+	{
+	    write_binary(o, M.parameter_name(p));
+	    bool modifiable = bool(M.parameter_is_modifiable_reg(p));
+	    write_binary(o, modifiable);
+	    if (modifiable)
+		write_value(o, M.get_parameter_value(p));
+	}
+
+	// 2. The random variables, in the order in which they were created.
+	auto& random = M.random_modifiables();
+	write_binary<long>(o, random.size());
+	for(int r: random)
+	    write_value(o, M.get_modifiable_value(r));
+    }
+
+    void read_model_state(istream& i, Model& M)
+    {
+	// 1. The parameters.
+	long n_parameters = read_binary<long>(i);
+	if (n_parameters != M.n_parameters())
+	    throw myexception()<<"Checkpoint has "<<n_parameters<<" parameters, but the model has "<<M.n_parameters()<<".  Was it written for a different model?";
+
+	for(int p=0;p<n_parameters;p++)
+	{
+	    string name = read_binary<string>(i);
+	    if (name != M.parameter_name(p))
+		throw myexception()<<"Checkpoint has parameter '"<<name<<"' where the model has parameter '"<<M.parameter_name(p)<<"'.  Was it written for a different model?";
+
+	    bool modifiable = read_binary<bool>(i);
+	    if (modifiable)
+		M.set_parameter_value(p, read_value(i));
+	}
+
+	// 2. The random variables.
+	long n_random = read_binary<long>(i);
+	for(long k=0;k<n_random;k++)
+	{
+	    // Some random variables are only created when the model is evaluated with
+	    // the values that we have restored so far.
+	    if (k >= M.random_modifiables().size())
+		M.probability();
+	    if (k >= M.random_modifiables().size())
+		throw myexception()<<"Checkpoint has "<<n_random<<" random variables, but the model only has "<<M.random_modifiables().size()<<".";
+
+	    int r = M.random_modifiables()[k];
+	    auto value = read_value(i);
+	    if (type_of_value(value) != type_of_value(M.get_modifiable_value(r)))
+		throw myexception()<<"Checkpoint has value '"<<value<<"' for random variable "<<k+1<<", which has value '"<<M.get_modifiable_value(r)<<"'.  Was it written for a different model?";
+	    M.set_modifiable_value(r, value);
+	}
+    }
+
+    long truncate_output_files(const string& filename)
+    {
+	auto file = open_checkpoint(filename);
+	long iterations = read_header(file, filename);
+
+	vector<std::pair<string,long>> sizes;
+	try
+	{
+	    sizes = read_output_file_sizes(file);
+	}
+	catch (myexception& e)
+	{
+	    e.prepend("Reading checkpoint '"+filename+"': ");
+	    throw;
+	}
+
+	auto dir = fs::path(filename).parent_path();
+	for(auto& entry: sizes)
+	{
+	    auto path = dir / entry.first;
+	    long size = entry.second;
+	    if (not fs::exists(path))
+		throw myexception()<<"Can't resume: output file '"<<path.string()<<"' is missing.";
+	    if (fs::file_size(path) < size)
+		throw myexception()<<"Can't resume: output file '"<<path.string()<<"' is shorter than it was at the checkpoint.";
+	    fs::resize_file(path, size);
+	}
+
+	return iterations;
+    }
+
+    // Write to a temporary file and then rename it, so that a run that is killed while
+    // writing a checkpoint still has the previous one.
+    void Sampler::write_checkpoint(const Model& P, long iterations, ostream& s_out) const
+    {
+	// The output files must contain exactly the samples before this iteration.
+	log_writer().flush();
+	s_out.flush();
+
+	string temp_filename = checkpoints.filename + ".tmp";
+	{
+	    std::ofstream file(temp_filename, std::ios::binary | std::ios::trunc);
+
+	    write_binary(file, checkpoint_header);
+	    write_binary(file, checkpoint_version);
+	    write_binary(file, iterations);
+
+	    write_binary<long>(file, checkpoints.output_files.size());
+	    for(auto& filename: checkpoints.output_files)
+	    {
+		write_binary(file, fs::path(filename).filename().string());
+		write_binary<long>(file, fs::file_size(filename));
+	    }
+
+	    write_binary(file, get_rng_state());
+
+	    auto PP = dynamic_cast<const Parameters*>(&P);
+	    write_binary(file, bool(PP));
+	    if (PP)
+		write_binary(file, PP->updown);
+
+	    write_model_state(file, P);
+
+	    write_state(file);
+
+	    write_move_stats(file, *this);
+
+	    file.close();
+	    if (not file)
+		throw myexception()<<"Failed to write checkpoint file '"<<temp_filename<<"'.";
+	}
+	fs::rename(temp_filename, checkpoints.filename);
+    }
+
+    long Sampler::read_checkpoint(Model& P)
+    {
+	auto file = open_checkpoint(checkpoints.filename);
+
+	long iterations = read_header(file, checkpoints.filename);
+
+	try
+	{
+	    read_output_file_sizes(file);
+
+	    set_rng_state(read_binary<string>(file));
+
+	    bool is_parameters = read_binary<bool>(file);
+	    auto PP = dynamic_cast<Parameters*>(&P);
+	    if (is_parameters != bool(PP))
+		throw myexception()<<"Checkpoint was written for a different kind of model.";
+	    if (PP)
+		PP->updown = read_binary<int>(file);
+
+	    read_model_state(file, P);
+
+	    read_state(file);
+
+	    read_move_stats(file, *this);
+	}
+	catch (myexception& e)
+	{
+	    e.prepend("Reading checkpoint '"+checkpoints.filename+"': ");
+	    throw;
+	}
+
+	return iterations;
+    }
+}
@@ -42,6 +42,7 @@
 #include "alignment/alignment-util.H"
 #include "dp/2way.H"
 #include "computation/expression/expression.H"
+#include "util/async-writer.H"
 
 using std::endl;
 using std::pair;
@@ -432,12 +433,11 @@ namespace MCMC {
 
     void FunctionLogger::operator()(const Model& M, long t)
     {
-	(*log_file)<<function(M,t);
-	log_file->flush();
+	log_writer().write(log_file, function(M,t));
     }
 
-    FunctionLogger::FunctionLogger(const std::string& filename, const logger_function<string>& L)
-	:log_file(new checked_ofstream(filename,false)),function(L)
+    FunctionLogger::FunctionLogger(const std::string& filename, const logger_function<string>& L, bool append)
+	:log_file(append?new checked_ofstream(filename,std::ios_base::app):new checked_ofstream(filename,false)),function(L)
     { }
 
     string ConcatFunction::operator()(const Model& M, long t)
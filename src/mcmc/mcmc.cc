@@ -44,6 +44,8 @@
 #include "proposals.H"
 #include "alignment/alignment-util.H"
 #include "computation/expression/expression.H"
+#include "util/async-writer.H"
+#include "checkpoint.H"
 
 #include "slice-sampling.H"
 
@@ -134,6 +136,20 @@ namespace MCMC {
 	else 
 	    o<<"DISABLED.\n";
     }
+
+    void Move::write_state(ostream& o) const
+    {
+	write_binary(o, name);
+	write_binary(o, iterations);
+    }
+
+    void Move::read_state(std::istream& i)
+    {
+	string name2 = read_binary<string>(i);
+	if (name2 != name)
+	    throw myexception()<<"Checkpoint has state for move '"<<name2<<"' where the sampler has move '"<<name<<"'.";
+	iterations = read_binary<double>(i);
+    }
   
     /// Add a sub-move \a m with weight \a l
     void MoveGroupBase::add(double l,const Move& m,bool enabled) 
@@ -144,6 +160,22 @@ namespace MCMC {
 	lambda.push_back(l);
     }
 
+    void MoveGroupBase::write_moves_state(ostream& o) const
+    {
+	write_binary<long>(o, moves.size());
+	for(auto& move: moves)
+	    move->write_state(o);
+    }
+
+    void MoveGroupBase::read_moves_state(std::istream& i)
+    {
+	long n = read_binary<long>(i);
+	if (n != moves.size())
+	    throw myexception()<<"Checkpoint has "<<n<<" submoves, but the sampler has "<<moves.size()<<".";
+	for(auto& move: moves)
+	    move->read_state(i);
+    }
+
     /// Calculate the sum of the weights of enabled moves in this group
     double MoveGroup::sum() const 
     {
@@ -238,6 +270,18 @@ namespace MCMC {
 	    moves[i]->show_enabled(o,depth+1);
     }
 
+    void MoveGroup::write_state(ostream& o) const
+    {
+	Move::write_state(o);
+	write_moves_state(o);
+    }
+
+    void MoveGroup::read_state(std::istream& i)
+    {
+	Move::read_state(i);
+	read_moves_state(i);
+    }
+
     void MoveAll::getorder(double l) {
 	order.clear();
 	for(int i=0;i<nmoves();i++) {
@@ -457,6 +501,24 @@ namespace MCMC {
 	n_learning_iterations = 0;
     }
 
+    void Slice_Move::write_state(ostream& o) const
+    {
+	Move::write_state(o);
+	write_binary(o, W);
+	write_binary(o, n_learning_iterations);
+	write_binary(o, n_tries);
+	write_binary(o, total_movement);
+    }
+
+    void Slice_Move::read_state(std::istream& i)
+    {
+	Move::read_state(i);
+	W = read_binary<double>(i);
+	n_learning_iterations = read_binary<int>(i);
+	n_tries = read_binary<int>(i);
+	total_movement = read_binary<double>(i);
+    }
+
     Slice_Move::Slice_Move(const string& s)
 	:Move(s),
 	 W(1),
@@ -821,6 +883,18 @@ namespace MCMC {
 	    moves[i]->show_enabled(o,depth+1);
     }
 
+    void MoveEach::write_state(ostream& o) const
+    {
+	Move::write_state(o);
+	write_moves_state(o);
+    }
+
+    void MoveEach::read_state(std::istream& i)
+    {
+	Move::read_state(i);
+	read_moves_state(i);
+    }
+
     void MoveArgSingle::operator()(owned_ptr<Model>& P,MoveStats& Stats,int arg) 
     {
 	if (log_verbose >= 3) clog<<" [single] move = "<<name<<endl;
@@ -840,6 +914,157 @@ namespace MCMC {
     
 
 
+    /// Determine the log of the heated probability of this chain at each temperature
+    vector<double> heated_probabilities(Parameters& P)
+    {
+#ifndef NDEBUG
+	log_double_t Pr1 = P.heated_probability();
+#endif
+	vector<double> Pr;
+	for(int i=0;i<P.PC->all_betas.size();i++)
+	{
+	    P.set_beta(P.PC->all_betas[i]);
+	    Pr.push_back(log(P.heated_probability()));
+	}
+	P.set_beta(P.PC->all_betas[P.beta_index]);
+#ifndef NDEBUG
+	log_double_t Pr2 = P.heated_probability();
+	assert(std::abs(log(Pr1)-log(Pr2)) < 1.0e-9);
+#endif
+
+	return Pr;
+    }
+
+    /// Propose swapping the chains at adjacent temperatures.
+    ///
+    /// Pr_all[c][j] is the log probability of chain c at temperature j.  We update the chain
+    /// at each temperature, and whether each chain has most recently visited the highest or
+    /// the lowest beta.
+    void propose_adjacent_swaps(const vector< vector<double> >& Pr_all, vector<int>& beta_to_chain,
+				vector<int>& updowns, MCMC::MoveStats& Stats)
+    {
+	const int n_chains = beta_to_chain.size();
+
+	//----- Compute an order of chains in decreasing order of beta -----//
+	MCMC::Result exchange(n_chains-1,0);
+
+	for(int i=0;i<3;i++)
+	{
+	    //----- Propose pairs of adjacent-temperature chains  ----//
+	    for(int j=0;j<n_chains-1;j++)
+	    {
+		int chain1 = beta_to_chain[j];
+		int chain2 = beta_to_chain[j+1];
+
+		// Compute the log probabilities for the two terms in the current order
+		double log_Pr1 = Pr_all[chain1][j] + Pr_all[chain2][j+1];
+		// Compute the log probabilities for the two terms in the proposed order
+		double log_Pr2 = Pr_all[chain2][j] + Pr_all[chain1][j+1];
+
+		// Swap the chain in beta positions j and j+1 if we accept the proposal
+		exchange.counts[j]++;
+		if (uniform() < exp(log_Pr2 - log_Pr1) )
+		{
+		    std::swap(beta_to_chain[j],beta_to_chain[j+1]);
+		    exchange.totals[j]++;
+		}
+	    }
+	}
+
+	// estimate average regeneration times for beta high->low->high
+	MCMC::Result regeneration(n_chains,0);
+
+	if (updowns[beta_to_chain[0]] == 0)
+	    regeneration.counts[beta_to_chain[0]]++;
+
+	for(int i=0;i<n_chains;i++)
+	    regeneration.totals[i]++;
+    
+
+	// fraction of visitors that most recently visited highest Beta
+	MCMC::Result f_recent_high(n_chains, 0); 
+
+	// the lowest chain has hit the lower bound more recently than the higher bound
+	updowns[beta_to_chain[0]] = 1;
+	// the highest chain has hit the upper bound more recently than the higher bound
+	updowns[beta_to_chain.back()] = 0;
+
+	for(int j=0;j<n_chains;j++)
+	    if (updowns[beta_to_chain[j]] == 1) {
+		f_recent_high.counts[j] = 1;
+		f_recent_high.totals[j] = 1;
+	    }
+	    else if (updowns[beta_to_chain[j]] == 0)
+		f_recent_high.counts[j] = 1;
+
+	Stats.inc("MC3.exchange",exchange);
+	Stats.inc("MC3.fracRecentHigh",f_recent_high);
+	Stats.inc("MC3.betaRegenerationTimes",regeneration);
+    }
+
+    void chain_exchange::exchange_adjacent_pairs(int chain, Parameters& P, MoveStats& Stats)
+    {
+	vector<double> Pr = heated_probabilities(P);
+
+	std::unique_lock<std::mutex> lock(mutex_);
+
+	Pr_all[chain] = Pr;
+	chain_to_beta[chain] = P.beta_index;
+	updowns[chain] = P.updown;
+	n_arrived++;
+
+	long my_generation = generation;
+	if (chain == 0)
+	{
+	    changed.wait(lock, [&]{return aborted or n_arrived == n_chains;});
+	    if (aborted)
+		throw myexception()<<"Chain "<<chain+1<<": stopping because another chain failed.";
+
+	    vector<int> beta_to_chain = invert(chain_to_beta);
+	    propose_adjacent_swaps(Pr_all, beta_to_chain, updowns, Stats);
+	    chain_to_beta = invert(beta_to_chain);
+
+	    n_arrived = 0;
+	    generation++;
+	}
+	else
+	{
+	    changed.notify_all();
+	    changed.wait(lock, [&]{return aborted or generation != my_generation;});
+	    if (aborted)
+		throw myexception()<<"Chain "<<chain+1<<": stopping because another chain failed.";
+	}
+	changed.notify_all();
+
+	int old_index = P.beta_index;
+	P.beta_index = chain_to_beta[chain];
+	P.updown = updowns[chain];
+	lock.unlock();
+
+	if (log_verbose)
+	    cerr<<"Chain["<<chain<<"] changing from "<<old_index<<" -> "<<P.beta_index<<endl;
+
+	P.set_beta(P.PC->all_betas[P.beta_index]);
+    }
+
+    void chain_exchange::abort()
+    {
+	std::unique_lock<std::mutex> lock(mutex_);
+	aborted = true;
+	changed.notify_all();
+    }
+
+    chain_exchange::chain_exchange(int n, int interval)
+	:n_chains(n),
+	 interval_(interval),
+	 Pr_all(n),
+	 chain_to_beta(n),
+	 updowns(n)
+    {
+	assert(n >= 2);
+	assert(interval >= 1);
+    }
+
 #ifdef HAVE_MPI
     void exchange_random_pairs(int iterations, Parameters& P, MCMC::MoveStats& /*Stats*/)
     {
@@ -950,21 +1175,9 @@ namespace MCMC {
 	int n_procs = world.size();
 
 	if (n_procs < 2) return;
-	if (not P.all_betas.size()) return;
-
-	// Determine the probability of this chain at each temperature
-	log_double_t Pr1 = P.heated_probability();
-	vector<double> Pr;
-	for(int i=0;i<P.all_betas.size();i++)
-	{
-	    P.set_beta(P.all_betas[i]);
-	    Pr.push_back(log(P.heated_probability()));
-	}
-	P.set_beta(P.all_betas[P.beta_index]);
-	log_double_t Pr2 = P.heated_probability();
-
-	assert(std::abs(log(Pr1)-log(Pr2)) < 1.0e-9);
+	if (not P.PC->all_betas.size()) return;
 
+	vector<double> Pr = heated_probabilities(P);
 
 	//  double oldbeta = beta;
 	vector< vector<double> > Pr_all;
@@ -984,65 +1197,7 @@ namespace MCMC {
 	vector<int> beta_to_chain = invert(chain_to_beta);
 
 	if (proc_id == 0)
-	{
-	    //----- Compute an order of chains in decreasing order of beta -----//
-	    MCMC::Result exchange(n_procs-1,0);
-
-	    for(int i=0;i<3;i++)
-	    {
-		//----- Propose pairs of adjacent-temperature chains  ----//
-		for(int j=0;j<n_procs-1;j++)
-		{
-		    int chain1 = beta_to_chain[j];
-		    int chain2 = beta_to_chain[j+1];
-
-		    // Compute the log probabilities for the two terms in the current order
-		    double log_Pr1 = Pr_all[chain1][j] + Pr_all[chain2][j+1];
-		    // Compute the log probabilities for the two terms in the proposed order
-		    double log_Pr2 = Pr_all[chain2][j] + Pr_all[chain1][j+1];
-
-		    // Swap the chain in beta positions j and j+1 if we accept the proposal
-		    exchange.counts[j]++;
-		    if (uniform() < exp(log_Pr2 - log_Pr1) )
-		    {
-			std::swap(beta_to_chain[j],beta_to_chain[j+1]);
-			exchange.totals[j]++;
-		    }
-		}
-	    }
-
-	    // estimate average regeneration times for beta high->low->high
-	    MCMC::Result regeneration(n_procs,0);
-
-	    if (updowns[beta_to_chain[0]] == 0)
-		regeneration.counts[beta_to_chain[0]]++;
-
-	    for(int i=0;i<n_procs;i++)
-		regeneration.totals[i]++;
-    
-
-	    // fraction of visitors that most recently visited highest Beta
-	    MCMC::Result f_recent_high(n_procs, 0); 
-
-	    // the lowest chain has hit the lower bound more recently than the higher bound
-	    updowns[beta_to_chain[0]] = 1;
-	    // the highest chain has hit the upper bound more recently than the higher bound
-	    updowns[beta_to_chain.back()] = 0;
-
-	    for(int j=0;j<n_procs;j++)
-		if (updowns[beta_to_chain[j]] == 1) {
-		    f_recent_high.counts[j] = 1;
-		    f_recent_high.totals[j] = 1;
-		}
-		else if (updowns[beta_to_chain[j]] == 0)
-		    f_recent_high.counts[j] = 1;
-
-	
-
-	    Stats.inc("MC3.exchange",exchange);
-	    Stats.inc("MC3.fracRecentHigh",f_recent_high);
-	    Stats.inc("MC3.betaRegenerationTimes",regeneration);
-	}
+	    propose_adjacent_swaps(Pr_all, beta_to_chain, updowns, Stats);
 
 	// recompute the chain_to_beta mapping
 	vector<int> chain_to_beta2 = invert(beta_to_chain);
@@ -1055,7 +1210,7 @@ namespace MCMC {
 	if (log_verbose)
 	    cerr<<"Proc["<<proc_id<<"] changing from "<<old_index<<" -> "<<P.beta_index<<endl;
 
-	P.set_beta(P.all_betas[P.beta_index]);
+	P.set_beta(P.PC->all_betas[P.beta_index]);
     }
 #endif
 
@@ -1115,9 +1270,19 @@ namespace MCMC {
 		PP->set_parameter_value(PP->find_parameter("*IModels.training"), new constructor("Prelude.True",0));
 	}
 
+	long first_iteration = 0;
+	if (checkpoints.resume)
+	{
+	    first_iteration = read_checkpoint(*P);
+	    s_out<<"Resuming from checkpoint at iteration "<<first_iteration<<".\n\n";
+	}
+
 	//---------------- Run the MCMC chain -------------------//
-	for(int iterations=0; iterations < max_iter; iterations++) 
+	for(int iterations=first_iteration; iterations < max_iter; iterations++) 
 	{
+	    if (checkpoints.interval > 0 and iterations > first_iteration and iterations%checkpoints.interval == 0)
+		write_checkpoint(*P, iterations, s_out);
+
 	    if (owned_ptr<Parameters> PP = P.as<Parameters>())
 	    {
 		// Free temporarily fixed parameters at iteration 5
@@ -1155,12 +1320,19 @@ namespace MCMC {
 	    if (P.as<Parameters>())
 		exchange_adjacent_pairs(iterations,*P.as<Parameters>(),*this);
 #endif
+
+	    //------------- Exchange Temperatures between threads -------------//
+	    if (exchange and P.as<Parameters>() and (iterations+1)%exchange->interval() == 0)
+		exchange->exchange_adjacent_pairs(chain, *P.as<Parameters>(), *this);
 	}
 
 	s_out<<(const MoveStats&)(*this);
 
 	mcmc_log(max_iter, max_iter, subsample, *P, s_out, *this, loggers);
 
+	// Make sure that the samples are on disk before we report that we are done.
+	log_writer().flush();
+
 	s_out<<"total samples = "<<max_iter<<endl;
     }
 }
@@ -233,12 +233,12 @@ void sample_tri_branch_type_one(owned_ptr<Model>& P, MoveStats& Stats,int b)
 }
 
 
-void sample_alignments_one(owned_ptr<Model>& P, MoveStats&,int b) 
+void sample_alignments_one(owned_ptr<Model>& P, MoveStats& Stats,int b) 
 {
   Parameters* PP = P.as<Parameters>();
   assert(PP->variable_alignment()); 
 
-  sample_alignment(*PP,b);
+  sample_alignment(*PP,Stats,b);
 }
 
 void sample_node_move(owned_ptr<Model>& P, MoveStats&,int node) 
@@ -613,7 +613,7 @@ void realign_from_tips(owned_ptr<Model>& P, MoveStats& Stats)
       if (node2 >= t.n_leaves())
 	  tri_sample_alignment(*P.as<Parameters>(), node2, node1);
       else
-	  sample_alignment(*P.as<Parameters>(), b);
+	  sample_alignment(*P.as<Parameters>(), Stats, b);
       sample_branch_length_(P,Stats,b);
       three_way_topology_sample(P,Stats,b);
   }
@@ -28,6 +28,8 @@
 #include "alignment/alignment-util2.H"
 #include "substitution/substitution.H"
 #include "dp/dp-matrix.H"
+#include "rng.H"
+#include "myexception.H"
 #include <boost/shared_ptr.hpp>
 
 // SYMMETRY: Because we are only sampling from alignments with the same fixed length
@@ -35,10 +37,12 @@
 
 using std::abs;
 using std::vector;
+using std::pair;
 using boost::dynamic_bitset;
 using namespace A2;
 
-boost::shared_ptr<DPmatrixSimple> sample_alignment_forward(data_partition P, const indel::PairHMM& hmm, int b)
+/// Construct the DP matrix for the pairwise alignment on branch b, without computing any cells.
+boost::shared_ptr<DPmatrixSimple> alignment_DP_matrix(data_partition P, const indel::PairHMM& hmm, int b)
 {
     assert(P.variable_alignment());
 
@@ -71,22 +75,137 @@ boost::shared_ptr<DPmatrixSimple> sample_alignment_forward(data_partition P, con
     state_emit[2] |= (1<<0);
     state_emit[3] |= 0;
 
-    int I = P.seqlength(t.source(b)); 
-    int J = P.seqlength(t.source(bb));
+    return boost::shared_ptr<DPmatrixSimple>( new DPmatrixSimple(HMM(state_emit, hmm.start_pi(), hmm, P.get_beta()),
+								 std::move(dists1), std::move(dists2), P.WeightedFrequencyMatrix()) );
+}
 
-    boost::shared_ptr<DPmatrixSimple> 
-	Matrices( new DPmatrixSimple(HMM(state_emit, hmm.start_pi(), hmm, P.get_beta()),
-				     std::move(dists1), std::move(dists2), P.WeightedFrequencyMatrix())
-	    );
+boost::shared_ptr<DPmatrixSimple> sample_alignment_forward(data_partition P, const indel::PairHMM& hmm, int b)
+{
+    auto t = P.t();
 
-    //------------------ Compute the DP matrix ---------------------//
-    vector<std::pair<int,int>> yboundaries(I+1, std::pair<int,int>(0,J));
+    int I = P.seqlength(t.source(b));
+    int J = P.seqlength(t.target(b));
 
-    Matrices->forward_band(yboundaries);
+    auto Matrices = alignment_DP_matrix(P, hmm, b);
+
+    //------------------ Compute the DP matrix ---------------------//
+    Matrices->forward_band(vector<pair<int,int>>(I+1, {0,J}));
 
     return Matrices;
 }
 
+/// For each prefix length x of sequence 1, the lengths y of sequence 2 that are within w of a path cell (x,y') of A.
+vector<pair<int,int>> band_around_alignment(const pairwise_alignment_t& A, int w)
+{
+    const int I = A.length1();
+    const int J = A.length2();
+
+    // Find the range of cells (x,y) on the path in each row x.
+    vector<pair<int,int>> yboundaries(I+1, {J,0});
+    yboundaries[0].first = 0;
+    for(int i=0,x=0,y=0;i<=A.size();i++)
+    {
+	if (i > 0)
+	{
+	    if (A.has_character1(i-1)) x++;
+	    if (A.has_character2(i-1)) y++;
+	}
+	yboundaries[x].first = std::min(yboundaries[x].first, y);
+	yboundaries[x].second = std::max(yboundaries[x].second, y);
+    }
+
+    // Both ends of the path's range are non-decreasing in x, so the band is too.
+    for(auto& range: yboundaries)
+    {
+	range.first = std::max(0, range.first - w);
+	range.second = std::min(J, range.second + w);
+    }
+
+    return yboundaries;
+}
+
+bool alignment_in_band(const pairwise_alignment_t& A, const vector<pair<int,int>>& yboundaries)
+{
+    for(int i=0,x=0,y=0;i<A.size();i++)
+    {
+	if (A.has_character1(i)) x++;
+	if (A.has_character2(i)) y++;
+	if (y < yboundaries[x].first or y > yboundaries[x].second)
+	    return false;
+    }
+    return true;
+}
+
+/// Compute the forward probabilities of M in a band of width w around A, doubling w until the
+/// paths that touch the outermost cells of the band carry at most the fraction tolerance of the total.
+///
+/// The paths in the band of width w that do not fit in the band of width w-1 are exactly the
+/// paths through its outermost cells, so their fraction is 1 - Z(w-1)/Z(w).  The band only
+/// depends on A and the model, so the reverse move computes the same band.
+vector<pair<int,int>> forward_banded(DPmatrixSimple& M, const pairwise_alignment_t& A, int w, double tolerance)
+{
+    assert(w > 0);
+
+    while(true)
+    {
+	auto yboundaries = band_around_alignment(A, w);
+	auto inner = band_around_alignment(A, w-1);
+
+	// The band already contains every cell, so it cannot grow.
+	if (inner == yboundaries)
+	{
+	    M.forward_band(yboundaries);
+	    return yboundaries;
+	}
+
+	M.forward_band(inner);
+	log_double_t Z_inner = M.Pr_sum_all_paths();
+
+	M.forward_band(yboundaries);
+	if (Z_inner >= (1.0 - tolerance) * M.Pr_sum_all_paths())
+	    return yboundaries;
+
+	w *= 2;
+    }
+}
+
+/// Propose a new alignment for branch b from a band around the current alignment, and accept or reject it.
+///
+/// The proposal probability is Pr(A2)/Z(A1), where Z(A1) is the total probability of the
+/// band around A1.  Therefore the acceptance ratio is Z(A1)/Z(A2), provided that A1 is in the
+/// band around A2.
+bool sample_alignment_banded(mutable_data_partition P, int b, int w, double tolerance)
+{
+    auto hmm = P.get_branch_HMM(b);
+
+    // The emission probabilities do not depend on the alignment of branch b, so both bands share them.
+    auto Matrices = alignment_DP_matrix(P, hmm, b);
+
+    auto A1 = P.get_pairwise_alignment(b);
+    forward_banded(*Matrices, A1, w, tolerance);
+    log_double_t Z1 = Matrices->Pr_sum_all_paths();
+
+    if (Z1 <= 0.0)
+    {
+	std::cerr<<"sample_alignment_banded( ): All paths have probability 0!"<<std::endl;
+	return false;
+    }
+
+    auto A2 = A2::get_pairwise_alignment_from_path(Matrices->sample_path());
+
+    auto band2 = forward_banded(*Matrices, A2, w, tolerance);
+    log_double_t Z2 = Matrices->Pr_sum_all_paths();
+
+    if (not alignment_in_band(A1, band2)) return false;
+
+    if (uniform() < double(Z1 / Z2))
+    {
+	P.set_pairwise_alignment(b, A2);
+	return true;
+    }
+    return false;
+}
+
 
 boost::shared_ptr<DPmatrixSimple> sample_alignment_base(mutable_data_partition P, const indel::PairHMM& hmm, int b) 
 {
@@ -111,7 +230,7 @@ boost::shared_ptr<DPmatrixSimple> sample_alignment_base(mutable_data_partition P
     return sample_alignment_base(P, P.get_branch_HMM(b), b);
 }
 
-void sample_alignment(Parameters& P,int b)
+void sample_alignment(Parameters& P, MCMC::MoveStats& Stats, int b)
 {
     //  if (any_branches_constrained(vector<int>(1,b), P.t(), P.PC->TC, P.PC->AC))
     //    return;
@@ -123,6 +242,18 @@ void sample_alignment(Parameters& P,int b)
     if (t.is_leaf_node(t.target(b)))
 	b = t.reverse(b);
   
+    // Only consider alignments close to the current one, for long sequences.
+    if (int w = P.load_value("alignment_band_width", 0))
+    {
+	if (w < 0)
+	    throw myexception()<<"alignment_band_width is "<<w<<", but it must be positive, or 0 to sample from all alignments.";
+	double tolerance = P.load_value("alignment_band_tolerance", 1.0e-4);
+	for(int j=0;j<P.n_data_partitions();j++)
+	    if (P[j].variable_alignment())
+		Stats.inc("sample_alignment_banded", MCMC::Result(sample_alignment_banded(P[j], b, w, tolerance)));
+	return;
+    }
+
 #if !defined(NDEBUG_DP) || !defined(NDEBUG)
     const Parameters P0 = P;
 #endif
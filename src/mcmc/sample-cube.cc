@@ -42,9 +42,10 @@ using std::pair;
 using std::endl;
 using boost::dynamic_bitset;
 
-boost::shared_ptr<DPcubeSimple> cube_sample_alignment_base(mutable_data_partition P, const data_partition& P0, 
-							   const vector<int>& nodes, const vector<int>& nodes0,
-							   int bandwidth)
+/// Construct the DP cube for realigning nodes[1], nodes[2], and nodes[3] around nodes[0], but don't fill it in.
+boost::shared_ptr<DPcubeSimple> cube_alignment_matrix(const data_partition& P, const data_partition& P0,
+						      const vector<int>& nodes, const vector<int>& nodes0,
+						      int bandwidth)
 {
     const auto t = P.t();
     const auto t0 = P0.t();
@@ -131,39 +132,54 @@ boost::shared_ptr<DPcubeSimple> cube_sample_alignment_base(mutable_data_partitio
 
     boost::shared_ptr<DPcubeSimple>
 	Matrices(new DPcubeSimple(m123, std::move(dists1), std::move(dists2), std::move(dists3), P.WeightedFrequencyMatrix()));
-    Matrices->forward_cube();
 
-    if (Matrices->Pr_sum_all_paths() <= 0.0) 
+    return Matrices;
+}
+
+/// Sample a path through a filled-in DP cube, and set the pairwise alignments on the branches to nodes[0].
+void cube_sample_path(mutable_data_partition P, const vector<int>& nodes, DPcubeSimple& Matrices)
+{
+    const auto t = P.t();
+
+    if (Matrices.Pr_sum_all_paths() <= 0.0) 
 	std::cerr<<"Constraints give this choice probability 0"<<std::endl;
 
     // If the DP matrix ended up having probability 0, don't try to sample a path through it!
-    if (Matrices->Pr_sum_all_paths() <= 0.0) 
+    if (Matrices.Pr_sum_all_paths() <= 0.0) 
     {
 #ifndef NDEBUG_DP
-	Matrices->clear();
+	Matrices.clear();
 #endif
-	return Matrices;
+	return;
     }
 
-    vector<int> path_g = Matrices->sample_path();
+    vector<int> path_g = Matrices.sample_path();
 
-    vector<int> path = Matrices->ungeneralize(path_g);
+    vector<int> path = Matrices.ungeneralize(path_g);
 
     for(int i=0;i<3;i++) {
 	int b = t.find_branch(nodes[0],nodes[i+1]);
-	P.set_pairwise_alignment(b, get_pairwise_alignment_from_path(path, *Matrices, 3, i));
+	P.set_pairwise_alignment(b, get_pairwise_alignment_from_path(path, Matrices, 3, i));
     }
 
 #ifdef NDEBUG_DP
-    Matrices->clear();
+    Matrices.clear();
 #endif
+}
 
-    return Matrices;
+boost::shared_ptr<DPengine> sample_cube_multi_calculation::construct_matrix(int i, int j)
+{
+    return cube_alignment_matrix(p[i][j], p[0][j], nodes[i], nodes[0], bandwidth);
+}
+
+void sample_cube_multi_calculation::fill_matrix(int i, int j)
+{
+    static_cast<DPcubeSimple&>(*Matrices[i][j]).forward_cube();
 }
 
-boost::shared_ptr<DPengine> sample_cube_multi_calculation::compute_matrix(int i, int j)
+void sample_cube_multi_calculation::sample_alignment(int i, int j)
 {
-    return cube_sample_alignment_base(p[i][j], p[0][j], nodes[i], nodes[0], bandwidth);
+    cube_sample_path(p[i][j], nodes[i], static_cast<DPcubeSimple&>(*Matrices[i][j]));
 }
 
 sample_cube_multi_calculation::sample_cube_multi_calculation(vector<Parameters>& pp,const vector< vector<int> >& nodes_,
@@ -179,6 +195,7 @@ int sample_cube_multi(vector<Parameters>& p,const vector< vector<int> >& nodes,
 {
     try {
 	sample_cube_multi_calculation tri(p, nodes, do_OS, do_OP);
+	tri.run_dp();
 
 	// The DP matrix construction didn't work.
 	if (tri.Pr[0] <= 0.0) return -1;
@@ -202,6 +219,7 @@ int sample_cube_multi(vector<Parameters>& p,const vector< vector<int> >& nodes,
 
 	//----------------- Part 1: Forward -----------------//
 	sample_cube_multi_calculation tri1(p, nodes, do_OS, do_OP, bandwidth);
+	tri1.run_dp();
 
 	// The DP matrix construction didn't work.
 	if (tri1.Pr[0] <= 0.0) return -1;
@@ -226,6 +244,7 @@ int sample_cube_multi(vector<Parameters>& p,const vector< vector<int> >& nodes,
 	std::abort();
 
 	sample_cube_multi_calculation tri2(p2, nodes, do_OS, do_OP, bandwidth);
+	tri2.run_dp();
 
 	// The DP matrix construction didn't work.
 	if (tri2.Pr[0] <= 0.0) return -1;
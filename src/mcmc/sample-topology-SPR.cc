@@ -38,6 +38,7 @@
 #include "dp/alignment-sums.H"
 #include "alignment/alignment-constraint.H"
 #include "substitution/substitution.H"
+#include "util/thread-pool.H"
 
 using MCMC::MoveStats;
 
@@ -968,7 +969,36 @@ move_pruned_subtree(Parameters& P,
 }
 
 vector<optional<vector<HMM::bitmask_t>>> A23_constraints(const Parameters& P, const vector<int>& nodes, bool original);
-log_double_t pr_sum_out_A_tri(Parameters P, const vector<optional<vector<HMM::bitmask_t>>>& a23, const vector<int>& nodes);
+
+/// Attachment points whose alignment DP matrices have been constructed, but not filled in.
+///
+/// Filling in the matrices doesn't use the model, so we do it for several attachment points
+/// at once on the worker threads.  Each matrix can be large, so we only keep as many as
+/// there are threads.
+class pending_sum_out_A
+{
+    spr_attachment_probabilities& Pr;
+    vector<pair<tree_edge,sum_out_A_tri_calculation>> pending;
+
+public:
+    void run()
+    {
+	worker_pool().parallel_for(pending.size(), [&](int k) {pending[k].second.run_dp();});
+
+	for(auto& p: pending)
+	    Pr[p.first] = p.second.Pr;
+	pending.clear();
+    }
+
+    void add(const tree_edge& target_edge, const Parameters& P, const vector<optional<vector<HMM::bitmask_t>>>& a23, const vector<int>& nodes)
+    {
+	pending.push_back({target_edge, sum_out_A_tri_calculation(P, a23, nodes)});
+	if (pending.size() >= n_threads())
+	    run();
+    }
+
+    pending_sum_out_A(spr_attachment_probabilities& P):Pr(P) {}
+};
 
 /// Compute the probability of pruning b1^t and regraftion at \a locations
 ///
@@ -999,10 +1029,11 @@ SPR_search_attachment_points(Parameters P, const tree_edge& subtree_edge, const
     Ps.push_back(P);
 
     spr_attachment_probabilities Pr;
+    pending_sum_out_A pending(Pr);
     if (sum_out_A)
     {
 	auto& nodes_ = nodes.at(I.initial_edge);
-	Pr[I.initial_edge] = pr_sum_out_A_tri(P, A23_constraints(P, nodes_, true), nodes_);
+	pending.add(I.initial_edge, P, A23_constraints(P, nodes_, true), nodes_);
     }
     else
 	Pr[I.initial_edge] = P.heated_likelihood() * P.prior_no_alignment();
@@ -1034,6 +1065,8 @@ SPR_search_attachment_points(Parameters P, const tree_edge& subtree_edge, const
     }
 
     // 3. Attach at each attachment branch at compute probabilities
+    //    The contexts in Ps share one heap, which can only evaluate one context at a time.  Therefore
+    //    only the alignment sums, which don't use the heap, are computed on the worker threads.
     for(int i=(int)I.attachment_branch_pairs.size()-1;i>0;i--)
     {
 	const tree_edge& target_edge = I.attachment_branch_pairs[i].edge;
@@ -1055,7 +1088,7 @@ SPR_search_attachment_points(Parameters P, const tree_edge& subtree_edge, const
 
 	// 3. Compute likelihood and probability
 	if (sum_out_A)
-	    Pr[target_edge] = pr_sum_out_A_tri(p, a23_constraint, nodes_);
+	    pending.add(target_edge, p, a23_constraint, nodes_);
 	else
 	    Pr[target_edge] = p.heated_likelihood() * p.prior_no_alignment();
 
@@ -1064,6 +1097,7 @@ SPR_search_attachment_points(Parameters P, const tree_edge& subtree_edge, const
 #endif
 	Ps.pop_back();
     }
+    pending.run();
 
 #ifndef NDEBUG
     auto peels1 = substitution::total_peel_internal_branches + substitution::total_peel_leaf_branches;
@@ -32,6 +32,7 @@
 #include "dp/dp-matrix.H"
 #include "substitution/substitution.H"
 #include "util/assert.hh"
+#include "util/thread-pool.H"
 
 //Assumptions:
 //  a) we assume that the internal node is the parent sequence in each of the sub-alignments
@@ -43,11 +44,10 @@ using std::endl;
 using boost::dynamic_bitset;
 using boost::optional;
 
+/// Construct the DP matrix for aligning nodes[1] to the 2-way alignment a23 of nodes[2] and nodes[3], but don't fill it in.
 boost::shared_ptr<DPmatrixConstrained>
-tri_sample_alignment_base(mutable_data_partition P, const vector<int>& nodes, const vector<HMM::bitmask_t>& a23,
-			  int /* bandwidth */)
+tri_alignment_matrix(const data_partition& P, const vector<int>& nodes, const vector<HMM::bitmask_t>& a23)
 {
-
     const auto t = P.t();
   
     assert(P.variable_alignment());
@@ -74,8 +74,6 @@ tri_sample_alignment_base(mutable_data_partition P, const vector<int>& nodes, co
     m123.B = P.get_beta();
 
     //------------- Compute sequence properties --------------//
-    int a1 = P.seqlength(nodes[1]);
-
     HMM::bitmask_t m23; m23.set(1); m23.set(2);
 
     auto dists1 = substitution::get_column_likelihoods(P, {b1}, get_indices_n(P.seqlength(nodes[1])), 2);
@@ -83,10 +81,6 @@ tri_sample_alignment_base(mutable_data_partition P, const vector<int>& nodes, co
 
     //-------------- Create alignment matrices ---------------//
 
-    vector<int> branches(3);
-    for(int i=0;i<3;i++)
-	branches[i] = t.find_branch(nodes[0],nodes[i+1]);
-
     boost::shared_ptr<DPmatrixConstrained> 
 	Matrices(new DPmatrixConstrained(m123, std::move(dists1), std::move(dists23), P.WeightedFrequencyMatrix()));
     Matrices->emit1 = 1;
@@ -125,6 +119,16 @@ tri_sample_alignment_base(mutable_data_partition P, const vector<int>& nodes, co
 	Matrices->states(c2+1) = allowed_states_for_mask[mask];
     }
 
+    return Matrices;
+}
+
+/// Fill in a matrix from tri_alignment_matrix( ).  This doesn't use the model, so it may be called on any thread.
+void tri_alignment_forward(DPmatrixConstrained& Matrices)
+{
+    // The emission probabilities have two extra columns at the start.
+    const int I = Matrices.dists1.n_columns()-1;
+    const int J = Matrices.dists2.n_columns()-1;
+
     //------------------ Compute the DP matrix ---------------------//
     //  vector<vector<int> > pins = get_pins(P.alignment_constraint,A,group1,group2 | group3,seq1,seq23);
     vector<vector<int> > pins(2);
@@ -132,45 +136,47 @@ tri_sample_alignment_base(mutable_data_partition P, const vector<int>& nodes, co
     //  Note: we don't even HAVE an a123 unless tree_changed == false!
     //  vector< pair<int,int> > yboundaries = get_y_ranges_for_band(bandwidth, seq23, seq1, seq123);
     //  vector<pair<int,int>> yboundaries(seq1.size()+1,pair<int,int>(0,seq23.size()));
-    vector<pair<int,int>> yboundaries(a1+1,{0,a23.size()});
+    vector<pair<int,int>> yboundaries(I,{0,J-1});
   
     // if the constraints are currently met but cannot be met
     if (pins.size() == 1 and pins[0][0] == -1)
 	; //std::cerr<<"Constraints cannot be expressed in terms of DP matrix paths!"<<std::endl;
     else 
     {
-	const int I = a1+1;
-	const int J = a23.size()+1;
 	yboundaries = boundaries_intersection(yboundaries, get_yboundaries_from_pins(I, J, pins));
 
-	Matrices->forward_band(yboundaries);
-	if (Matrices->Pr_sum_all_paths() <= 0.0) 
+	Matrices.forward_band(yboundaries);
+	if (Matrices.Pr_sum_all_paths() <= 0.0) 
 	    std::cerr<<"Constraints give this choice probability 0"<<std::endl;
     }
+}
+
+/// Sample a path through a matrix from tri_alignment_forward( ), and set the pairwise alignments on the branches to nodes[0].
+void tri_sample_path(mutable_data_partition P, const vector<int>& nodes, DPmatrixConstrained& Matrices)
+{
+    const auto t = P.t();
 
     // If the DP matrix ended up having probability 0, don't try to sample a path through it!
-    if (Matrices->Pr_sum_all_paths() <= 0.0) 
+    if (Matrices.Pr_sum_all_paths() <= 0.0) 
     {
 #ifndef NDEBUG_DP
-	Matrices->clear();
+	Matrices.clear();
 #endif
-	return Matrices;
+	return;
     }
 
-    vector<int> path_g = Matrices->sample_path();
+    vector<int> path_g = Matrices.sample_path();
 
-    vector<int> path = Matrices->ungeneralize(path_g);
+    vector<int> path = Matrices.ungeneralize(path_g);
 
     for(int i=0;i<3;i++) {
 	int b = t.find_branch(nodes[0],nodes[i+1]);
-	P.set_pairwise_alignment(b, get_pairwise_alignment_from_path(path, *Matrices, 3, i));
+	P.set_pairwise_alignment(b, get_pairwise_alignment_from_path(path, Matrices, 3, i));
     }
 
 #ifdef NDEBUG_DP
-    Matrices->clear();
+    Matrices.clear();
 #endif
-
-    return Matrices;
 }
 
 // If there is an original 3way alignment, then we need to construct a 3way path and project to 2way
@@ -201,10 +207,10 @@ vector<optional<vector<HMM::bitmask_t>>> A23_constraints(const Parameters& P, co
     return a23;
 }
 
-boost::shared_ptr<DPmatrixConstrained>
-tri_sample_alignment_base(mutable_data_partition P, const data_partition& P0,
-			  const vector<int>& nodes, const vector<int>& nodes0,
-			  int bandwidth)
+/// The 2-way alignment of nodes[2] and nodes[3] that we align nodes[1] to, where P0 is the configuration before the move.
+vector<HMM::bitmask_t> A23_constraint(const data_partition& P, const data_partition& P0,
+				      const vector<int>& nodes, const vector<int>& nodes0,
+				      int bandwidth)
 {
     const auto t0 = P0.t();
 
@@ -224,20 +230,16 @@ tri_sample_alignment_base(mutable_data_partition P, const data_partition& P0,
 	assert(t0.is_connected(nodes[0],nodes[3]));
     }
 
-    vector<HMM::bitmask_t> a23;
-
     if (tree_changed)
     {
 	assert(P.t().is_connected(nodes0[2], nodes0[3]));  // The old attachment point should not be split in the new      tree
 	assert(t0.is_connected(nodes0[2],nodes0[0]));  // The old attachment point should     be split in the original tree
 	assert(t0.is_connected(nodes0[3],nodes0[0]));
 
-	a23 = A23_constraint(P0, nodes, false);
+	return A23_constraint(P0, nodes, false);
     }
     else
-	a23 = A23_constraint(P, nodes, true);
-
-    return tri_sample_alignment_base(P, nodes, a23, bandwidth);
+	return A23_constraint(P, nodes, true);
 }
 
 
@@ -259,24 +261,32 @@ sample_A3_multi_calculation::sample_A3_multi_calculation(vector<Parameters>& pp,
 {
 }
 
-log_double_t pr_sum_out_A_tri(Parameters P, const vector<optional<vector<HMM::bitmask_t>>>& a23, const vector<int>& nodes)
+sum_out_A_tri_calculation::sum_out_A_tri_calculation(const Parameters& P, const vector<optional<vector<HMM::bitmask_t>>>& a23, const vector<int>& nodes)
+    :Pr_other(P.prior_no_alignment()),
+     Matrices(P.n_data_partitions())
 {
-    log_double_t Pr = P.prior_no_alignment();
-
-    // sum of substitution and alignment probability over all paths
     for(int j=0;j<P.n_data_partitions();j++)
     {
 	if (P[j].variable_alignment()) {
-	    auto Matrices = tri_sample_alignment_base(P[j], nodes, *a23[j], -1);
-	    Pr *= Matrices->Pr_sum_all_paths();
-	    Pr *= pow(other_subst(P[j], nodes), P[j].get_beta());
-	    Pr *= other_prior(P[j], nodes);
+	    Matrices[j] = tri_alignment_matrix(P[j], nodes, *a23[j]);
+	    Pr_other *= pow(other_subst(P[j], nodes), P[j].get_beta());
+	    Pr_other *= other_prior(P[j], nodes);
 	}
 	else
-	    Pr *= P[j].heated_likelihood();
+	    Pr_other *= P[j].heated_likelihood();
     }
+}
 
-    return Pr;
+void sum_out_A_tri_calculation::run_dp()
+{
+    // sum of substitution and alignment probability over all paths
+    Pr = Pr_other;
+    for(auto& M: Matrices)
+	if (M)
+	{
+	    tri_alignment_forward(*M);
+	    Pr *= M->Pr_sum_all_paths();
+	}
 }
 
 void sample_A3_multi_calculation::run_dp()
@@ -299,15 +309,33 @@ void sample_A3_multi_calculation::run_dp()
     //----------- Generate the different states and Matrices ---------//
     C1 = A3::correction(p[0],nodes[0]);
 
+    vector<pair<int,int>> matrices;
     for(int i=0;i<p.size();i++) 
     {
 	Matrices[i].resize(p[i].n_data_partitions());
 	for(int j=0;j<p[i].n_data_partitions();j++) {
 	    if (p[i][j].variable_alignment())
-		Matrices[i][j] = compute_matrix(i,j);
+	    {
+		Matrices[i][j] = construct_matrix(i,j);
+		matrices.push_back({i,j});
+	    }
 	}
     }
 
+    // Filling in a matrix doesn't use the model, so we fill in several at once on the worker threads.
+    // Sampling the alignments modifies the model and uses the RNG, so we do that afterwards on this
+    // thread, in the same order for any number of threads.  Filled-in matrices can be large, so we
+    // only fill in as many at a time as there are threads.
+    for(int k1=0;k1<matrices.size();k1+=n_threads())
+    {
+	int k2 = std::min<int>(k1 + n_threads(), matrices.size());
+
+	worker_pool().parallel_for(k2 - k1, [&](int k) {fill_matrix(matrices[k1+k].first, matrices[k1+k].second);});
+
+	for(int k=k1;k<k2;k++)
+	    sample_alignment(matrices[k].first, matrices[k].second);
+    }
+
     //-------- Calculate corrections to path probabilities ---------//
 
     for(int i=0; i<p.size(); i++) 
@@ -479,9 +507,19 @@ int sample_A3_multi_calculation::choose(bool correct)
     return C;
 }
 
-boost::shared_ptr<DPengine> sample_tri_multi_calculation::compute_matrix(int i, int j)
+boost::shared_ptr<DPengine> sample_tri_multi_calculation::construct_matrix(int i, int j)
+{
+    return tri_alignment_matrix(p[i][j], nodes[i], A23_constraint(p[i][j], p[0][j], nodes[i], nodes[0], bandwidth));
+}
+
+void sample_tri_multi_calculation::fill_matrix(int i, int j)
+{
+    tri_alignment_forward(static_cast<DPmatrixConstrained&>(*Matrices[i][j]));
+}
+
+void sample_tri_multi_calculation::sample_alignment(int i, int j)
 {
-    return tri_sample_alignment_base(p[i][j], p[0][j], nodes[i], nodes[0], bandwidth);
+    tri_sample_path(p[i][j], nodes[i], static_cast<DPmatrixConstrained&>(*Matrices[i][j]));
 }
 
 sample_tri_multi_calculation::sample_tri_multi_calculation(vector<Parameters>& pp,const vector< vector<int> >& nodes_,
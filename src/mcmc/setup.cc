@@ -909,12 +909,17 @@ void do_pre_burnin(const variables_map& args, owned_ptr<Model>& P, ostream& out_
 /// \param P               The model and current state
 /// \param max_iterations  The number of iterations to run (unless interrupted).
 /// \param files           Files to log output into
+/// \param exchange        Swaps temperatures with chains in other threads, if not null
+/// \param chain           The index of this chain among the chains that share 'exchange'
 ///
 void do_sampling(const variables_map& args,
 		 owned_ptr<Model>& P,
 		 long int max_iterations,
 		 ostream& s_out,
-		 const vector<MCMC::Logger>& loggers)
+		 const vector<MCMC::Logger>& loggers,
+		 const MCMC::checkpoint_settings& checkpoints,
+		 const std::shared_ptr<MCMC::chain_exchange>& exchange,
+		 int chain)
 {
     using namespace MCMC;
 
@@ -975,6 +980,11 @@ void do_sampling(const variables_map& args,
     for(int i=0;i<loggers.size();i++)
 	sampler.add_logger(loggers[i]);
 
+    if (exchange)
+	sampler.set_exchange(exchange, chain);
+
+    sampler.set_checkpoints(checkpoints);
+
     //------------------- Enable and Disable moves ---------------------------//
     enable_disable_transition_kernels(sampler,args);
 
@@ -31,6 +31,7 @@
 #include "models/parameters.H"
 #include "rng.H"
 #include "substitution/substitution.H"
+#include "util/thread-pool.H"
 #include "alignment/alignment-util.H"
 #include "alignment/alignment-util2.H"
 #include "prior.H"
@@ -369,7 +370,26 @@ log_double_t data_partition::prior() const
 
 const Likelihood_Cache_Branch& data_partition::cache(int b) const
 {
-    return P->evaluate(DPC().conditional_likelihoods_for_branch[b]).as_<Likelihood_Cache_Branch>();
+    auto& LCB = P->evaluate(DPC().conditional_likelihoods_for_branch[b]).as_<Likelihood_Cache_Branch>();
+    LCB.wait();
+
+    // When checking single precision, everything except the likelihood itself uses the double-precision values.
+    if (LCB.reference)
+	return *LCB.reference;
+    return LCB;
+}
+
+void data_partition::start_likelihood() const
+{
+    if (worker_pool().n_workers() == 0) return;
+
+    // The 1- and 2-sequence likelihoods don't use the conditional likelihoods.
+    if (t().n_nodes() <= 2) return;
+
+    // Evaluating the conditional likelihoods for the branches into the root submits the
+    // peeling for every out-of-date branch to the worker pool, but doesn't wait for it.
+    for(int b: t().branches_in(subst_root()))
+	P->evaluate(DPC().conditional_likelihoods_for_branch[b]);
 }
 
 log_double_t data_partition::likelihood() const 
@@ -693,7 +713,7 @@ smodel_methods::smodel_methods(const expression_ref& E, context& C)
     rate = C.add_compute_expression({var("SModel.rate"), S});
 
     frequencies = C.add_compute_expression({var("SModel.componentFrequencies"), S});
-    transition_p = C.add_compute_expression({var("SModel.branchTransitionP"), S});
+    transition_p = C.add_compute_expression({var("SModel.branchTransitionPs"), S});
 }
 
 vector<int> edges_connecting_to_node(const Tree& T, int n)
@@ -1212,8 +1232,17 @@ log_double_t Parameters::prior() const
     return prior_no_alignment() * prior_alignment();
 }
 
+void Parameters::start_likelihood() const
+{
+    for(int i=0;i<n_data_partitions();i++)
+	get_data_partition(i).start_likelihood();
+}
+
 log_double_t Parameters::likelihood() const 
 {
+    // Start the peeling for all partitions before we wait for any of them.
+    start_likelihood();
+
     log_double_t Pr = 1;
     for(int i=0;i<n_data_partitions();i++) 
 	Pr *= get_data_partition(i).likelihood();
@@ -1222,6 +1251,11 @@ log_double_t Parameters::likelihood() const
 
 log_double_t Parameters::heated_likelihood() const 
 {
+    // Start the peeling for all partitions before we wait for any of them.
+    for(int i=0;i<n_data_partitions();i++)
+	if (get_data_partition(i).get_beta() != 0)
+	    get_data_partition(i).start_likelihood();
+
     log_double_t Pr = 1;
 
     for(int i=0;i<n_data_partitions();i++) 
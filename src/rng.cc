@@ -22,6 +22,7 @@
 #include <cmath>
 #include <fstream>
 #include <iostream>
+#include <sstream>
 #include <boost/random/random_device.hpp>
 
 #include "rng.H"
@@ -48,7 +49,9 @@ unsigned long get_random_seed()
     return s;
 }
 
-std::mt19937_64 standard;
+// Each thread has its own generator, so that chains running in different threads
+// do not share state.  Threads other than the main thread must seed it themselves.
+thread_local std::mt19937_64 standard;
 
 unsigned long myrand_init(unsigned long s) 
 {
@@ -61,6 +64,19 @@ unsigned long myrand_init()
     return myrand_init(get_random_seed());
 }
 
+std::string get_rng_state()
+{
+    std::ostringstream state;
+    state<<standard;
+    return state.str();
+}
+
+void set_rng_state(const std::string& s)
+{
+    std::istringstream state(s);
+    state>>standard;
+}
+
 double uniform() 
 {
     return std::uniform_real_distribution<>(0.0, 1.0)(standard);
@@ -72,6 +72,7 @@ po::options_description general_options(int level)
     if (level >= 2)
 	general.add_options()
 	    ("package-path,P",value<string>(),"Directories to search for packages.")
+	    ("module-cache",value<string>(),"Directory in which to save and reuse compiled modules.")
 	    ("set",value<vector<string> >()->composing(),"Set key=<value>");
     return general;
 }
@@ -90,10 +91,14 @@ po::options_description mcmc_options(int level)
 	mcmc.add_options()
 	    ("subsample,x",value<int>()->default_value(1),"Factor by which to subsample.")
 	    ("seed,s", value<unsigned long>(),"Random seed.")
-	    ("pre-burnin",value<int>()->default_value(3),"Iterations to refine initial tree.");
+	    ("pre-burnin",value<int>()->default_value(3),"Iterations to refine initial tree.")
+	    ("threads,j",value<int>()->default_value(1),"Number of threads to use.")
+	    ("checkpoint",value<long int>(),"Save the state every <arg> iterations so that the run can be resumed.")
+	    ("resume",value<string>(),"Resume the run in directory <arg> from its last checkpoint.");
 
     if (level >= 2)
 	mcmc.add_options()
+	    ("likelihood-precision",value<string>()->default_value("double"),"Store conditional likelihoods as 'double', 'single', or 'check' single against double.")
 	    ("enable",value<string>(),"Comma-separated list of kernels to enable.")
 	    ("disable",value<string>(),"Comma-separated list of kernels to disable.")
 	    ("Rao-Blackwellize",value<string>(),"Parameter names to print Rao-Blackwell averages for.");
@@ -101,7 +106,9 @@ po::options_description mcmc_options(int level)
     if (level >= 3)
 	mcmc.add_options()
 	    ("beta",value<string>(),"MCMCMC temperature")
-	    ("dbeta",value<string>(),"MCMCMC temperature changes");
+	    ("dbeta",value<string>(),"MCMCMC temperature changes")
+	    ("chains",value<int>()->default_value(1),"Number of heated chains to run in separate threads.")
+	    ("swap-interval",value<int>()->default_value(1),"Iterations between temperature swaps for --chains.");
 
     return mcmc;
 }
@@ -289,6 +296,10 @@ variables_map parse_cmd_line(int argc,char* argv[])
 
     load_bali_phy_rc(args,all);
 
+    // The rest of the command line will come from the run that we are resuming.
+    if (args.count("resume"))
+	return args;
+
     std::set<string> commands;
     for(auto word : {"align", "Model", "model", "print", "test-module"})
 	if (args.count(word))
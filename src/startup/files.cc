@@ -2,6 +2,7 @@
 #include <iostream>
 
 #include "files.H"
+#include "../io.H"
 #include "util.H"
 #include "myexception.H"
 #include "version.H"
@@ -247,3 +248,72 @@ vector<shared_ptr<ostream>> init_files(int proc_id, const string& dirname,
     return files;
 }
 
+vector<shared_ptr<ostream>> resume_files(int proc_id, const string& dirname, long iterations)
+{
+    vector<shared_ptr<ostream>> files;
+
+    string base = dirname + "/C" + convertToString(proc_id+1);
+    files.push_back(shared_ptr<ostream>(new checked_ofstream(base + ".out", std::ios_base::app)));
+    files.push_back(shared_ptr<ostream>(new checked_ofstream(base + ".err", std::ios_base::app)));
+
+    ostream& s_out = *files[0];
+    time_t now = time(NULL);
+    s_out<<"resuming at iteration "<<iterations<<": "<<ctime(&now)<<endl;
+    s_out<<"hostname: "<<hostname()<<endl;
+    s_out<<"PID: "<<getpid()<<endl;
+    s_out<<endl;
+
+    return files;
+}
+
+string checkpoint_filename(int proc_id, const string& dirname)
+{
+    return dirname + "/C" + convertToString(proc_id+1) + ".checkpoint";
+}
+
+// This is everything that starts with C<proc_id+1>. except the .err file, which
+// we keep in full, and the run info and checkpoint, which are not logs.
+vector<string> chain_output_files(int proc_id, const string& dirname)
+{
+    string prefix = "C" + convertToString(proc_id+1) + ".";
+
+    vector<string> filenames;
+    for(auto& entry: fs::directory_iterator(dirname))
+    {
+	string name = entry.path().filename().string();
+	if (name.compare(0, prefix.size(), prefix) != 0) continue;
+
+	string extension = name.substr(prefix.size());
+	if (extension == "err" or extension == "run.json" or extension == "checkpoint" or extension == "checkpoint.tmp") continue;
+
+	filenames.push_back(entry.path().string());
+    }
+    std::sort(filenames.begin(), filenames.end());
+    return filenames;
+}
+
+vector<string> load_command_line(const string& dirname)
+{
+    string filename = dirname + "/C1.run.json";
+    checked_ifstream file(filename, "run info file");
+
+    json info;
+    try
+    {
+	file>>info;
+    }
+    catch (std::exception& e)
+    {
+	throw myexception()<<"Can't read the command line from '"<<filename<<"': "<<e.what();
+    }
+
+    if (not info.count("command") or not info["command"].is_array())
+	throw myexception()<<"'"<<filename<<"' does not contain the command line.";
+
+    vector<string> command;
+    for(auto& arg: info["command"])
+	command.push_back(arg);
+    if (command.empty())
+	throw myexception()<<"'"<<filename<<"' contains an empty command line.";
+    return command;
+}
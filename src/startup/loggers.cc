@@ -306,7 +306,7 @@ string table_logger_line(MCMC::TableFunction<string>& TF, const Model& M, long t
     return o.str();
 }
 
-vector<MCMC::Logger> construct_loggers(owned_ptr<Model>& M, int subsample, const vector<string>& Rao_Blackwellize, int proc_id, const string& dir_name)
+vector<MCMC::Logger> construct_loggers(owned_ptr<Model>& M, int subsample, const vector<string>& Rao_Blackwellize, int proc_id, const string& dir_name, bool append)
 {
     // FIXME - avoid the need to manually SubSampleFunction to every logger?
 
@@ -323,7 +323,7 @@ vector<MCMC::Logger> construct_loggers(owned_ptr<Model>& M, int subsample, const
 
     auto TF3 = [TL](const Model& M, long t) mutable { return table_logger_line(*TL,M,t); };
 
-    Logger s = FunctionLogger(base +".log", Subsample_Function(TF, subsample));
+    Logger s = FunctionLogger(base +".log", Subsample_Function(TF, subsample), append);
   
     // Write out scalar numerical variables (and functions of them) to C<>.p
     loggers.push_back( s );
@@ -331,7 +331,7 @@ vector<MCMC::Logger> construct_loggers(owned_ptr<Model>& M, int subsample, const
     if (not P) return loggers;
 
     // Write out the (scaled) tree each iteration to C<>.trees
-    loggers.push_back( FunctionLogger(base + ".trees", Subsample_Function(TreeFunction()<<"\n", subsample) ) );
+    loggers.push_back( FunctionLogger(base + ".trees", Subsample_Function(TreeFunction()<<"\n", subsample), append) );
   
     // Write out the MAP point to C<>.MAP - later change to a dump format that could be reloaded?
     {
@@ -343,14 +343,14 @@ vector<MCMC::Logger> construct_loggers(owned_ptr<Model>& M, int subsample, const
 		if ((*P)[i].variable_alignment())
 		    F<<AlignmentFunction(i)<<"\n\n";
 	F<<TreeFunction()<<"\n\n";
-	loggers.push_back( FunctionLogger(base + ".MAP", MAP_Function(F)) );
+	loggers.push_back( FunctionLogger(base + ".MAP", MAP_Function(F), append) );
     }
 
     // Write out the probability that each column is in a particular substitution component to C<>.P<>.CAT
     if (P->contains_key("log-categories"))
 	for(int i=0;i<P->n_data_partitions();i++)
 	    loggers.push_back( FunctionLogger(base + ".P" + convertToString(i+1)+".CAT", 
-					      Subsample_Function(Mixture_Components_Function(i),subsample) ) );
+					      Subsample_Function(Mixture_Components_Function(i),subsample), append ) );
 
     // Write out the alignments for each (variable) partition to C<>.P<>.fastas
     if (P->t().n_nodes() > 1)
@@ -365,7 +365,7 @@ vector<MCMC::Logger> construct_loggers(owned_ptr<Model>& M, int subsample, const
 		F<<Ancestral_Sequences_Function(i);
 //		F<<AlignmentFunction(i);
 		
-		loggers.push_back( FunctionLogger(filename, Subsample_Function(F,10*subsample) ) );
+		loggers.push_back( FunctionLogger(filename, Subsample_Function(F,10*subsample), append ) );
 	    }
 
     return loggers;
@@ -0,0 +1,238 @@
+/*
+  Copyright (C) 2018 Benjamin Redelings
+
+  This file is part of BAli-Phy.
+
+  BAli-Phy is free software; you can redistribute it and/or modify it under
+  the terms of the GNU General Public License as published by the Free
+  Software Foundation; either version 2, or (at your option) any later
+  version.
+
+  BAli-Phy is distributed in the hope that it will be useful, but WITHOUT ANY
+  WARRANTY; without even the implied warranty of MERCHANTABILITY or
+  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+  for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with BAli-Phy; see the file COPYING.  If not see
+  <http://www.gnu.org/licenses/>.  */
+
+#include "substitution/kernels.H"
+#include "matrix.H"
+#include <algorithm>
+#include <Eigen/Dense>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+// With target_clones the compiler emits an AVX-512, an AVX2, and a baseline copy of
+// each kernel, and picks one at load time based on the CPU that we are running on.
+#ifdef HAVE_TARGET_CLONES
+#define SIMD_DISPATCH __attribute__((target_clones("avx512f","avx2","default")))
+#else
+#define SIMD_DISPATCH
+#endif
+
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+
+namespace substitution {
+
+    template <typename T>
+    basic_transposed_transition_matrices<T>::basic_transposed_transition_matrices(const EVector& transition_P)
+	:n_models_(transition_P.size()),
+	 n_states_(transition_P[0].as_<Box<Matrix>>().size1())
+    {
+	const int N = n_states_;
+	data.resize(n_models_*N*N);
+
+	for(int m=0;m<n_models_;m++)
+	{
+	    const Matrix& Q = transition_P[m].as_<Box<Matrix>>();
+	    assert(Q.size1() == N and Q.size2() == N);
+	    T* QT = data.data() + m*N*N;
+	    for(int s1=0;s1<N;s1++)
+		for(int s2=0;s2<N;s2++)
+		    QT[s2*N + s1] = Q(s1,s2);
+	}
+    }
+
+    template class basic_transposed_transition_matrices<double>;
+    template class basic_transposed_transition_matrices<float>;
+
+    // We accumulate R += QT(s2,:) * C(s2) so that the inner loop runs over contiguous
+    // memory without a horizontal reduction.  Each R(s1) is still summed over s2 in
+    // increasing order, just like the dot-product form.
+    template <int N, typename T>
+    ALWAYS_INLINE T propagate_fixed(T* __restrict__ R, const T* __restrict__ C,
+				    const basic_transposed_transition_matrices<T>& QT)
+    {
+	const int n_models = QT.n_models();
+	T max_R = 0;
+	for(int m=0;m<n_models;m++)
+	{
+	    const T* __restrict__ qt = QT[m];
+	    const T* __restrict__ c = C + m*N;
+	    T* __restrict__ r = R + m*N;
+
+	    T temp[N];
+	    for(int s1=0;s1<N;s1++)
+		temp[s1] = 0;
+
+	    for(int s2=0;s2<N;s2++)
+	    {
+		T c_s2 = c[s2];
+		for(int s1=0;s1<N;s1++)
+		    temp[s1] += qt[s2*N + s1] * c_s2;
+	    }
+
+	    for(int s1=0;s1<N;s1++)
+	    {
+		r[s1] = temp[s1];
+		max_R = std::max(max_R, temp[s1]);
+	    }
+	}
+	return max_R;
+    }
+
+    template <typename T>
+    ALWAYS_INLINE T propagate_generic(T* __restrict__ R, const T* __restrict__ C,
+				      const basic_transposed_transition_matrices<T>& QT)
+    {
+	const int N = QT.n_states();
+	const int n_models = QT.n_models();
+	T max_R = 0;
+	for(int m=0;m<n_models;m++)
+	{
+	    const T* __restrict__ qt = QT[m];
+	    const T* __restrict__ c = C + m*N;
+	    T* __restrict__ r = R + m*N;
+
+	    for(int s1=0;s1<N;s1++)
+		r[s1] = 0;
+
+	    for(int s2=0;s2<N;s2++)
+	    {
+		T c_s2 = c[s2];
+		for(int s1=0;s1<N;s1++)
+		    r[s1] += qt[s2*N + s1] * c_s2;
+	    }
+
+	    for(int s1=0;s1<N;s1++)
+		max_R = std::max(max_R, r[s1]);
+	}
+	return max_R;
+    }
+
+    // Specialize for nucleotides, amino acids, and codons.
+    SIMD_DISPATCH
+    double propagate_4(double* R, const double* C, const transposed_transition_matrices& QT)
+    {
+	return propagate_fixed<4>(R, C, QT);
+    }
+
+    SIMD_DISPATCH
+    double propagate_20(double* R, const double* C, const transposed_transition_matrices& QT)
+    {
+	return propagate_fixed<20>(R, C, QT);
+    }
+
+    SIMD_DISPATCH
+    double propagate_61(double* R, const double* C, const transposed_transition_matrices& QT)
+    {
+	return propagate_fixed<61>(R, C, QT);
+    }
+
+    SIMD_DISPATCH
+    double propagate_N(double* R, const double* C, const transposed_transition_matrices& QT)
+    {
+	return propagate_generic(R, C, QT);
+    }
+
+    double propagate(double* R, const double* C, const transposed_transition_matrices& QT)
+    {
+	switch(QT.n_states())
+	{
+	case 4:
+	    return propagate_4(R, C, QT);
+	case 20:
+	    return propagate_20(R, C, QT);
+	case 61:
+	    return propagate_61(R, C, QT);
+	default:
+	    return propagate_N(R, C, QT);
+	}
+    }
+
+    // In single precision, each vector register holds twice as many entries.
+    SIMD_DISPATCH
+    float propagate_4(float* R, const float* C, const transposed_transition_matrices_float& QT)
+    {
+	return propagate_fixed<4>(R, C, QT);
+    }
+
+    SIMD_DISPATCH
+    float propagate_20(float* R, const float* C, const transposed_transition_matrices_float& QT)
+    {
+	return propagate_fixed<20>(R, C, QT);
+    }
+
+    SIMD_DISPATCH
+    float propagate_61(float* R, const float* C, const transposed_transition_matrices_float& QT)
+    {
+	return propagate_fixed<61>(R, C, QT);
+    }
+
+    SIMD_DISPATCH
+    float propagate_N(float* R, const float* C, const transposed_transition_matrices_float& QT)
+    {
+	return propagate_generic(R, C, QT);
+    }
+
+    float propagate(float* R, const float* C, const transposed_transition_matrices_float& QT)
+    {
+	switch(QT.n_states())
+	{
+	case 4:
+	    return propagate_4(R, C, QT);
+	case 20:
+	    return propagate_20(R, C, QT);
+	case 61:
+	    return propagate_61(R, C, QT);
+	default:
+	    return propagate_N(R, C, QT);
+	}
+    }
+
+    // Each model occupies n_states consecutive entries of a column, so we view the
+    // block for model m as an (n_columns x n_states) matrix with stride matrix_size.
+    // Eigen's GEMM takes care of the cache blocking.
+    template <typename T>
+    void propagate_block_(T* R, const T* C, int n_columns, const basic_transposed_transition_matrices<T>& QT)
+    {
+	typedef Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> RowMatrix;
+
+	const int n_models = QT.n_models();
+	const int N = QT.n_states();
+	const int matrix_size = n_models * N;
+
+	for(int m=0;m<n_models;m++)
+	{
+	    Eigen::Map<const RowMatrix, 0, Eigen::OuterStride<>> Cm(C + m*N, n_columns, N, Eigen::OuterStride<>(matrix_size));
+	    Eigen::Map<RowMatrix, 0, Eigen::OuterStride<>> Rm(R + m*N, n_columns, N, Eigen::OuterStride<>(matrix_size));
+	    Eigen::Map<const RowMatrix> QTm(QT[m], N, N);
+
+	    Rm.noalias() = Cm * QTm;
+	}
+    }
+
+    void propagate_block(double* R, const double* C, int n_columns, const transposed_transition_matrices& QT)
+    {
+	propagate_block_(R, C, n_columns, QT);
+    }
+
+    void propagate_block(float* R, const float* C, int n_columns, const transposed_transition_matrices_float& QT)
+    {
+	propagate_block_(R, C, n_columns, QT);
+    }
+}
@@ -18,12 +18,18 @@
   <http://www.gnu.org/licenses/>.  */
 
 #include "substitution.H"
+#include "substitution/kernels.H"
+#include "util/thread-pool.H"
 #include "models/parameters.H"
 #include "sequence/alphabet.H"
 #include "rng.H"
 #include <cmath>
 #include <valarray>
 #include <vector>
+#include <functional>
+#include <array>
+#include <algorithm>
+#include <cstdint>
 #include "util.H"
 #include "math/logprod.H"
 #include "dp/hmm.H"
@@ -202,32 +208,48 @@ pair<int,int> sample(const Matrix& M)
     return {-1,-1};
 }
 
-inline void element_assign(double* M1, int size, double d)
+// The conditional likelihoods may be stored as double or float (T), but we always
+// multiply them into doubles.
+
+template <typename T>
+inline void element_assign(T* M1, int size, double d)
 {
     for(int i=0;i<size;i++)
 	M1[i] = d;
 }
 
-inline void element_assign(double* __restrict__ M1, const double* __restrict__ M2, int size)
+template <typename T>
+inline void element_assign(T* __restrict__ M1, const T* __restrict__ M2, int size)
 {
     for(int i=0;i<size;i++)
 	M1[i] = M2[i];
 }
 
-inline void element_prod_modify(double* __restrict__ M1, const double* __restrict__ M2, int size)
+template <typename T>
+inline void element_prod_modify(double* __restrict__ M1, const T* __restrict__ M2, int size)
 {
     for(int i=0;i<size;i++)
 	M1[i] *= M2[i];
 }
 
-inline void element_prod_assign(double* __restrict__ M1,
-				const double* __restrict__ M2,
-				const double* __restrict__ M3, int size)
+template <typename T>
+inline void element_prod_assign(T* __restrict__ M1,
+				const T* __restrict__ M2,
+				const T* __restrict__ M3, int size)
 {
     for(int i=0;i<size;i++)
 	M1[i] = M2[i]*M3[i];
 }
 
+template <typename T>
+inline T element_max(const T* M1, int size)
+{
+    T max = 0;
+    for(int i=0;i<size;i++)
+	max = std::max(max, M1[i]);
+    return max;
+}
+
 inline double element_sum(const double* M1, int size)
 {
     double sum = 0;
@@ -237,7 +259,8 @@ inline double element_sum(const double* M1, int size)
 }
 
 
-inline double element_prod_sum(const double* __restrict__ M1, const double* __restrict__ M2, int size)
+template <typename T>
+inline double element_prod_sum(const double* __restrict__ M1, const T* __restrict__ M2, int size)
 {
     double sum = 0;
     for(int i=0;i<size;i++)
@@ -246,9 +269,10 @@ inline double element_prod_sum(const double* __restrict__ M1, const double* __re
     return sum;
 }
 
+template <typename T>
 inline double element_prod_sum(const double* __restrict__ M1,
-			       const double* __restrict__ M2,
-			       const double* __restrict__ M3,
+			       const T* __restrict__ M2,
+			       const T* __restrict__ M3,
 			       int size)
 {
     double sum = 0;
@@ -258,10 +282,11 @@ inline double element_prod_sum(const double* __restrict__ M1,
     return sum;
 }
 
+template <typename T>
 inline double element_prod_sum(const double* __restrict__ M1,
-			       const double* __restrict__ M2,
-			       const double* __restrict__ M3,
-			       const double* __restrict__ M4,
+			       const T* __restrict__ M2,
+			       const T* __restrict__ M3,
+			       const T* __restrict__ M4,
 			       int size)
 {
     double sum = 0;
@@ -298,12 +323,26 @@ pair<int,int> sample(const double* M, int n_models, int n_states)
 
 namespace substitution {
 
-    int total_peel_leaf_branches=0;
-    int total_peel_internal_branches=0;
-    int total_peel_branches=0;
-    int total_likelihood=0;
-    int total_calc_root_prob=0;
-    long int total_root_clv_length=0;
+    std::atomic<int> total_peel_leaf_branches(0);
+    std::atomic<int> total_peel_internal_branches(0);
+    std::atomic<int> total_peel_branches(0);
+    std::atomic<int> total_likelihood(0);
+    std::atomic<int> total_calc_root_prob(0);
+    std::atomic<long> total_root_clv_length(0);
+
+    clv_precision likelihood_precision = clv_precision::double_precision;
+    std::atomic<long> total_precision_checks(0);
+    std::atomic<double> max_precision_error(0);
+    std::atomic<long> total_double_columns(0);
+
+    /// Multiply m by column i of LCB, which may be stored in single precision.
+    inline void element_prod_modify(double* m, const Likelihood_Cache_Branch& LCB, int i)
+    {
+	if (LCB.single_precision())
+	    ::element_prod_modify(m, LCB.column<float>(i), LCB.matrix_size());
+	else
+	    ::element_prod_modify(m, LCB[i], LCB.matrix_size());
+    }
 
     inline double sum(const std::vector<double>& f,int l1,const alphabet& a)
     {
@@ -352,6 +391,156 @@ namespace substitution {
     }
 
 
+    /// The number of columns in each piece of work when peeling or computing the root probability in parallel.
+    ///
+    /// This is a multiple of peel_block_columns, so that each chunk is split into the same blocks as a serial pass would use.
+    constexpr int column_chunk_size = 8 * peel_block_columns;
+
+    /// Call f(c1,c2) for consecutive chunks [c1,c2) of the columns [0,L), possibly on several threads at once.
+    void for_column_chunks(int L, const std::function<void(int,int)>& f)
+    {
+	const int n_chunks = (L + column_chunk_size - 1)/column_chunk_size;
+	worker_pool().parallel_for(n_chunks, [&](int k)
+				   {
+				       int c1 = k * column_chunk_size;
+				       f(c1, std::min(L, c1 + column_chunk_size));
+				   });
+    }
+
+    /// The log of the scale factor for conditional likelihoods stored as T.
+    template <typename T> double log_scale_min_for();
+    template <> double log_scale_min_for<double>() {return log_scale_min;}
+    template <> double log_scale_min_for<float>() {return log_scale_min_float;}
+
+    /// Compute the probability p[c] of each of the columns [c1,c2) at the root, where column c contains column columns[c][j] of LCB[j] (or nothing if -1).
+    template <typename T>
+    void root_column_probabilities(const Likelihood_Cache_Branch* const LCB[3],
+				   const vector<std::array<int,3>>& columns,
+				   const Matrix& F,
+				   int c1, int c2,
+				   double* p)
+    {
+	const int n_models = F.size1();
+	const int n_states = F.size2();
+	const int matrix_size = n_models * n_states;
+
+#ifdef DEBUG_SUBSTITUTION
+	// scratch matrix 
+	Matrix S(n_models,n_states);
+#endif
+
+	for(int c=c1;c<c2;c++)
+	{
+	    const T* m[3];
+	    int mi=0;
+	    for(int j=0;j<3;j++)
+		if (columns[c][j] >= 0)
+		    m[mi++] = LCB[j]->column<T>(columns[c][j]);
+
+	    double p_col = 1;
+	    if (mi==3)
+		p_col = element_prod_sum(F.begin(), m[0], m[1], m[2], matrix_size);
+	    else if (mi==2)
+		p_col = element_prod_sum(F.begin(), m[0], m[1], matrix_size);
+	    else if (mi==1)
+		p_col = element_prod_sum(F.begin(), m[0], matrix_size);
+
+#ifdef DEBUG_SUBSTITUTION
+	    //-------------- Set letter & model prior probabilities  ---------------//
+	    element_assign(S,F);
+
+	    //-------------- Propagate and collect information at 'root' -----------//
+	    for(int j=0;j<mi;j++)
+		element_prod_modify(S.begin(), m[j], matrix_size);
+
+	    //------------ Check that individual models are not crazy -------------//
+	    for(int m=0;m<n_models;m++) {
+		double p_model=0;
+		for(int s=0;s<n_states;s++)
+		    p_model += S(m,s);
+		// A specific model (e.g. the INV model) could be impossible
+		assert(0 <= p_model and p_model <= 1.00000000001);
+	    }
+
+	    double p_col2 = element_sum(S);
+
+	    assert((p_col - p_col2)/std::max(p_col,p_col2) < 1.0e-9);
+#endif
+
+	    p[c] = p_col;
+	}
+    }
+
+    /// Multiply together the column probabilities, each raised to the power counts[c], and the likelihoods stored in the LCBs.
+    ///
+    /// The column probabilities may be computed in parallel, but we always multiply them
+    /// together in the same order so that the result does not depend on the number of threads.
+    template <typename T>
+    log_double_t root_probability(const Likelihood_Cache_Branch* const LCB[3],
+				  const vector<std::array<int,3>>& columns,
+				  const vector<int>& counts,
+				  const Matrix& F)
+    {
+	const int L = columns.size();
+	assert(counts.size() == L);
+
+	vector<double> p(L);
+	for_column_chunks(L, [&](int c1, int c2) {root_column_probabilities<T>(LCB, columns, F, c1, c2, p.data());});
+
+	log_prod total;
+	int scale = 0;
+	for(int c=0;c<L;c++)
+	{
+	    // SOME model must be possible
+	    assert(0 <= p[c] and p[c] <= 1.00000000001);
+
+	    // This might do a log( ) operation.
+	    total.mult_with_count(p[c],counts[c]);
+
+	    for(int j=0;j<3;j++)
+		if (columns[c][j] >= 0)
+		    scale += counts[c] * LCB[j]->scale(columns[c][j]);
+	}
+
+	log_double_t Pr = total;
+	for(int j=0;j<3;j++)
+	    Pr *= LCB[j]->other_subst;
+	Pr.log() += log_scale_min_for<T>() * scale;
+	return Pr;
+    }
+
+    /// Compute the root probability in the precision that the LCBs are stored in.
+    ///
+    /// When checking single precision, record the error and return the double-precision result.
+    log_double_t root_probability(const Likelihood_Cache_Branch* const LCB[3],
+				  const vector<std::array<int,3>>& columns,
+				  const vector<int>& counts,
+				  const Matrix& F)
+    {
+	assert(LCB[0]->single_precision() == LCB[1]->single_precision());
+	assert(LCB[0]->single_precision() == LCB[2]->single_precision());
+
+	if (not LCB[0]->single_precision())
+	    return root_probability<double>(LCB, columns, counts, F);
+
+	log_double_t Pr = root_probability<float>(LCB, columns, counts, F);
+
+	if (LCB[0]->reference)
+	{
+	    const Likelihood_Cache_Branch* reference[3] = {LCB[0]->reference.get(), LCB[1]->reference.get(), LCB[2]->reference.get()};
+	    log_double_t Pr2 = root_probability<double>(reference, columns, counts, F);
+
+	    total_precision_checks++;
+	    double error = std::abs(Pr.log() - Pr2.log());
+	    double max_error = max_precision_error;
+	    while (error > max_error and not max_precision_error.compare_exchange_weak(max_error, error))
+		;
+	    Pr = Pr2;
+	}
+
+	return Pr;
+    }
+
     log_double_t calc_root_probability(const Likelihood_Cache_Branch* LCB1,
 				       const Likelihood_Cache_Branch* LCB2,
 				       const Likelihood_Cache_Branch* LCB3,
@@ -365,9 +554,12 @@ namespace substitution {
 	assert(LCB3->n_columns() == A2.length1());
 	total_calc_root_prob++;
 
+	LCB1->wait();
+	LCB2->wait();
+	LCB3->wait();
+
 	const int n_models = F.size1();
 	const int n_states = F.size2();
-	const int matrix_size = n_models * n_states;
 
 	assert(n_models == LCB1->n_models());
 	assert(n_states == LCB1->n_states());
@@ -378,13 +570,12 @@ namespace substitution {
 	assert(n_models == LCB3->n_models());
 	assert(n_states == LCB3->n_states());
 
-#ifdef DEBUG_SUBSTITUTION
-	// scratch matrix 
-	Matrix S(n_models,n_states);
-#endif
+	// Find the columns of LCB1, LCB2, and LCB3 in each column, in the order that we multiply them together.
+	vector<std::array<int,3>> columns;
+	vector<int> counts;
+	columns.reserve(A0.length2());
+	counts.reserve(A0.length2());
 
-	log_prod total;
-	int scale = 0;
 	const int AL0 = A0.size();
 	const int AL1 = A1.size();
 	const int AL2 = A2.size();
@@ -396,35 +587,26 @@ namespace substitution {
 	    while(i0 < AL0 and not A0.has_character2(i0))
 	    {
 		assert(A0.has_character1(i0));
-		double p_col = element_prod_sum(F.begin(), (*LCB1)[s0], matrix_size );
-		assert(0 <= p_col and p_col <= 1.00000000001);
-		total.mult_with_count(p_col,(*LCB1).count(s0));
-		scale += LCB1->scale(s0);
+		columns.push_back({s0,-1,-1});
+		counts.push_back(LCB1->count(s0));
 		i0++;
 		s0++;
-		total_root_clv_length++;
 	    }
 	    while (i1 < AL1 and not A1.has_character2(i1))
 	    {
 		assert(A1.has_character1(i1));
-		double p_col = element_prod_sum(F.begin(), (*LCB2)[s1], matrix_size );
-		assert(0 <= p_col and p_col <= 1.00000000001);
-		total.mult_with_count(p_col,(*LCB2).count(s1));
-		scale += LCB2->scale(s1);
+		columns.push_back({-1,s1,-1});
+		counts.push_back(LCB2->count(s1));
 		i1++;
 		s1++;
-		total_root_clv_length++;
 	    }
 	    while (i2 < AL2 and not A2.has_character2(i2))
 	    {
 		assert(A2.has_character1(i2));
-		double p_col = element_prod_sum(F.begin(), (*LCB3)[s2], matrix_size );
-		assert(0 <= p_col and p_col <= 1.00000000001);
-		total.mult_with_count(p_col,(*LCB3).count(s2));
-		scale += LCB3->scale(s2);
+		columns.push_back({-1,-1,s2});
+		counts.push_back(LCB3->count(s2));
 		i2++;
 		s2++;
-		total_root_clv_length++;
 	    }
 
 	    if (i2 >= AL2)
@@ -447,81 +629,32 @@ namespace substitution {
 	    i2++;
 
 	    int count = 1;
-	    const double* m[3];
-	    int mi=0;
+	    std::array<int,3> column = {-1,-1,-1};
 	    if (not_gap0)
 	    {
-		m[mi++] = ((*LCB1)[s0]);
-		scale += (*LCB1).scale(s0);
 		count = (*LCB1).count(s0);
-		s0++;
+		column[0] = s0++;
 	    }
 	    if (not_gap1)
 	    {
-		m[mi++] = ((*LCB2)[s1]);
-		scale += (*LCB2).scale(s1);
 		count = (*LCB2).count(s1);
-		s1++;
+		column[1] = s1++;
 	    }
 	    if (not_gap2)
 	    {
-		m[mi++] = ((*LCB3)[s2]);
-		scale += (*LCB3).scale(s2);
 		count = (*LCB3).count(s2);
-		s2++;
-	    }
-
-	    double p_col = 1;
-	    if (mi==3)
-		p_col = element_prod_sum(F.begin(), m[0], m[1], m[2], matrix_size);
-	    else if (mi==2)
-		p_col = element_prod_sum(F.begin(), m[0], m[1], matrix_size);
-	    else if (mi==1)
-		p_col = element_prod_sum(F.begin(), m[0], matrix_size);
-
-#ifdef DEBUG_SUBSTITUTION
-	    //-------------- Set letter & model prior probabilities  ---------------//
-	    element_assign(S,F);
-
-	    //-------------- Propagate and collect information at 'root' -----------//
-	    if (not_gap0)
-		element_prod_modify(S.begin(),(*LCB1)[s0], matrix_size);
-	    if (not_gap1)
-		element_prod_modify(S.begin(),(*LCB2)[s1], matrix_size);
-	    if (not_gap2)
-		element_prod_modify(S.begin(),(*LCB3)[s2], matrix_size);
-
-	    //------------ Check that individual models are not crazy -------------//
-	    for(int m=0;m<n_models;m++) {
-		double p_model=0;
-		for(int s=0;s<n_states;s++)
-		    p_model += S(m,s);
-		// A specific model (e.g. the INV model) could be impossible
-		assert(0 <= p_model and p_model <= 1.00000000001);
+		column[2] = s2++;
 	    }
-
-	    double p_col2 = element_sum(S);
-
-	    assert((p_col - p_col2)/std::max(p_col,p_col2) < 1.0e-9);
-#endif
-
-	    // SOME model must be possible
-	    assert(0 <= p_col and p_col <= 1.00000000001);
-
-	    // This might do a log( ) operation.
-	    total.mult_with_count(p_col,count);
-	    //      std::clog<<" i = "<<i<<"   p = "<<p_col<<"  total = "<<total<<"\n";
+	    columns.push_back(column);
+	    counts.push_back(count);
 
 	    s3++;
-	    total_root_clv_length++;
 	}
 
-	log_double_t Pr = total;
-	Pr *= LCB1->other_subst;
-	Pr *= LCB2->other_subst;
-	Pr *= LCB3->other_subst;
-	Pr.log() += log_scale_min * scale;
-	return Pr;
+	total_root_clv_length += columns.size();
+
+	const Likelihood_Cache_Branch* LCB[3] = {LCB1, LCB2, LCB3};
+	return root_probability(LCB, columns, counts, F);
     }
 
     log_double_t calc_root_probability_SEV(const Likelihood_Cache_Branch* LCB1,
@@ -532,9 +665,12 @@ namespace substitution {
     {
 	total_calc_root_prob++;
 
+	LCB1->wait();
+	LCB2->wait();
+	LCB3->wait();
+
 	const int n_models = F.size1();
 	const int n_states = F.size2();
-	const int matrix_size = n_models * n_states;
 
 	assert(n_models == LCB1->n_models());
 	assert(n_states == LCB1->n_states());
@@ -545,11 +681,6 @@ namespace substitution {
 	assert(n_models == LCB3->n_models());
 	assert(n_states == LCB3->n_states());
 
-#ifdef DEBUG_SUBSTITUTION
-	// scratch matrix 
-	Matrix S(n_models,n_states);
-#endif
-
 	const auto& bits1 = LCB1->bits;
 	const auto& bits2 = LCB2->bits;
 	const auto& bits3 = LCB3->bits;
@@ -562,8 +693,16 @@ namespace substitution {
 
 	total_root_clv_length += L;
 
-	log_prod total;
-	int scale = 0;
+	// The columns here are already the distinct site patterns from compress_alignment( ), and
+	// counts[c] is the weight of pattern c.  Two distinct site patterns must differ in the subtree
+	// pattern of LCB1, LCB2, or LCB3, so there is nothing left to merge at the root.
+	//
+	// Find the columns of LCB1, LCB2, and LCB3 in each column that is not empty.
+	vector<std::array<int,3>> columns;
+	vector<int> column_counts;
+	columns.reserve(L);
+	column_counts.reserve(L);
+
 	for(int c=0,i1=0,i2=0,i3=0;c<L;c++)
 	{
 	    bool non_gap1 = bits1.test(c);
@@ -572,73 +711,20 @@ namespace substitution {
 
 	    if ((not non_gap1) and (not non_gap2) and (not non_gap3)) continue;
 
-	    const double* m[3];
-	    int mi=0;
-
-	    if (non_gap1)
-	    {
-		m[mi++] = ((*LCB1)[i1]);
-		scale += (*LCB1).scale(i1);
-	    }
-	    if (non_gap2)
-	    {
-		m[mi++] = ((*LCB2)[i2]);
-		scale += (*LCB2).scale(i2);
-	    }
-	    if (non_gap3)
-	    {
-		m[mi++] = ((*LCB3)[i3]);
-		scale += (*LCB3).scale(i3);
-	    }
-
-	    double p_col = 1.0;
-	    if (mi==3)
-		p_col = element_prod_sum(F.begin(), m[0], m[1], m[2], matrix_size);
-	    else if (mi==2)
-		p_col = element_prod_sum(F.begin(), m[0], m[1], matrix_size);
-	    else if (mi==1)
-		p_col = element_prod_sum(F.begin(), m[0], matrix_size);
-
-#ifdef DEBUG_SUBSTITUTION
-	    //-------------- Set letter & model prior probabilities  ---------------//
-	    element_assign(S,F);
-
-	    //-------------- Propagate and collect information at 'root' -----------//
+	    std::array<int,3> column = {-1,-1,-1};
 	    if (non_gap1)
-		element_prod_modify(S.begin(),(*LCB1)[i0], matrix_size);
+		column[0] = i1++;
 	    if (non_gap2)
-		element_prod_modify(S.begin(),(*LCB2)[i1], matrix_size);
+		column[1] = i2++;
 	    if (non_gap3)
-		element_prod_modify(S.begin(),(*LCB3)[i2], matrix_size);
-
-	    //------------ Check that individual models are not crazy -------------//
-	    for(int m=0;m<n_models;m++) {
-		double p_model=0;
-		for(int s=0;s<n_states;s++)
-		    p_model += S(m,s);
-		// A specific model (e.g. the INV model) could be impossible
-		assert(0 <= p_model and p_model <= 1.00000000001);
-	    }
-
-	    double p_col2 = element_sum(S);
-
-	    assert((p_col - p_col2)/std::max(p_col,p_col2) < 1.0e-9);
-#endif
-
-	    // SOME model must be possible
-	    assert(0 <= p_col and p_col <= 1.00000000001);
-
-	    if (non_gap1) i1++;
-	    if (non_gap2) i2++;
-	    if (non_gap3) i3++;
-
-	    total.mult_with_count(p_col,counts[c]);
-	    //      std::clog<<" i = "<<i<<"   p = "<<p_col<<"  total = "<<total<<"\n";
+		column[2] = i3++;
+	    columns.push_back(column);
+	    column_counts.push_back(counts[c]);
 	}
 
-	log_double_t Pr = total;
-	Pr.log() += log_scale_min * scale;
-	return Pr;
+	// The SEV cache branches all have other_subst = 1.
+	const Likelihood_Cache_Branch* LCB[3] = {LCB1, LCB2, LCB3};
+	return root_probability(LCB, columns, column_counts, F);
     }
 
     log_double_t calc_root_probability2(const data_partition& P,const vector<int>& rb,const matrix<int>& index) 
@@ -761,28 +847,32 @@ namespace substitution {
     }
 
 
-    Likelihood_Cache_Branch*
-    peel_leaf_branch(const vector<int>& sequence, const vector<int>& counts, const alphabet& a, const EVector& transition_P)
+    /// Is the likelihood calculation using single-precision storage for conditional likelihoods?
+    bool use_single_precision()
     {
-	total_peel_leaf_branches++;
+	return likelihood_precision != clv_precision::double_precision;
+    }
 
+    /// Should each single-precision cache branch carry a double-precision reference copy?
+    bool check_single_precision()
+    {
+	return likelihood_precision == clv_precision::check;
+    }
+
+    template <typename T>
+    void peel_leaf_branch(const vector<int>& sequence, const alphabet& a, const EVector& transition_P, Likelihood_Cache_Branch* LCB)
+    {
 	//    const vector<unsigned>& smap = MC.state_letters();
 
 	int L0 = sequence.size();
-	assert(counts.size() == L0);
 
 	const int n_models  = transition_P.size();
 	const int n_states  = transition_P[0].as_<Box<Matrix>>().size1();
 	const int matrix_size = n_models * n_states;
 
-	auto LCB = new Likelihood_Cache_Branch(L0, n_models, n_states);
-    
 	for(int i=0;i<L0;i++)
 	{
-	    assert(counts[0] >= 1);
-	    LCB->count(i) = counts[i];
-
-	    double* R = (*LCB)[i];
+	    T* R = LCB->column<T>(i);
 	    // compute the distribution at the parent node
 	    int l2 = sequence[i];
 
@@ -815,61 +905,90 @@ namespace substitution {
 	}
 
 	LCB->other_subst = 1;
+    }
+
+    Likelihood_Cache_Branch*
+    peel_leaf_branch(const vector<int>& sequence, const vector<int>& counts, const alphabet& a, const EVector& transition_P)
+    {
+	total_peel_leaf_branches++;
+
+	int L0 = sequence.size();
+	assert(counts.size() == L0);
+
+	const int n_models  = transition_P.size();
+	const int n_states  = transition_P[0].as_<Box<Matrix>>().size1();
+
+	auto LCB = new Likelihood_Cache_Branch(L0, n_models, n_states, use_single_precision());
+	if (check_single_precision())
+	    LCB->reference.reset(new Likelihood_Cache_Branch(L0, n_models, n_states));
+
+	for(int i=0;i<L0;i++)
+	{
+	    assert(counts[0] >= 1);
+	    LCB->count(i) = counts[i];
+	    if (LCB->reference)
+		LCB->reference->count(i) = counts[i];
+	}
+
+	if (LCB->single_precision())
+	    peel_leaf_branch<float>(sequence, a, transition_P, LCB);
+	else
+	    peel_leaf_branch<double>(sequence, a, transition_P, LCB);
+
+	if (LCB->reference)
+	    peel_leaf_branch<double>(sequence, a, transition_P, LCB->reference.get());
 
 	return LCB;
     }
 
+    /// Number the distinct letters in a leaf sequence in order of first appearance.
+    vector<int> leaf_patterns(const vector<int>& sequence)
+    {
+	vector<int> patterns(sequence.size());
+	if (sequence.empty()) return patterns;
+
+	// Letters and letter classes are small integers, so we can look them up in a table.
+	auto range = std::minmax_element(sequence.begin(), sequence.end());
+	const int min_letter = *range.first;
+	vector<int> pattern_for_letter(*range.second - min_letter + 1, -1);
+
+	int n_patterns = 0;
+	for(int i=0;i<sequence.size();i++)
+	{
+	    int& p = pattern_for_letter[sequence[i] - min_letter];
+	    if (p < 0) p = n_patterns++;
+	    patterns[i] = p;
+	}
+	return patterns;
+    }
+
     Likelihood_Cache_Branch*
     peel_leaf_branch_SEV(const vector<int>& sequence, const alphabet& a, const EVector& transition_P, const boost::dynamic_bitset<>& mask)
     {
 	total_peel_leaf_branches++;
 
-	//    const vector<unsigned>& smap = MC.state_letters();
-
 	int L0 = sequence.size();
 
 	const int n_models  = transition_P.size();
 	const int n_states  = transition_P[0].as_<Box<Matrix>>().size1();
-	const int matrix_size = n_models * n_states;
 
-	auto LCB = new Likelihood_Cache_Branch(L0, n_models, n_states);
+	auto LCB = new Likelihood_Cache_Branch(L0, n_models, n_states, use_single_precision());
 	LCB->bits = mask;
-    
-	for(int i=0;i<L0;i++)
+	LCB->patterns = leaf_patterns(sequence);
+	if (check_single_precision())
 	{
-	    double* R = (*LCB)[i];
-	    // compute the distribution at the parent node
-	    int l2 = sequence[i];
-
-	    if (a.is_letter(l2))
-		for(int m=0;m<n_models;m++) 
-		{
-		    const Matrix& Q = transition_P[m].as_<Box<Matrix>>();
-		    for(int s1=0;s1<n_states;s1++)
-			R[m*n_states + s1] = Q(s1,l2);
-		}
-	    else if (a.is_letter_class(l2)) 
-	    {
-		// FIXME - why is the sum(Q,l1,l2,a) function so much slower?
-		// FIXME - would this slowness affect the modulated peeling functions also?
-		const alphabet::fmask_t& fmask = a.letter_fmask(l2);
-		for(int m=0;m<n_models;m++) 
-		{
-		    const Matrix& Q = transition_P[m].as_<Box<Matrix>>();
-		    for(int s1=0;s1<n_states;s1++)
-		    {
-			double sum = 0.0;
-			for(int s2=0;s2<n_states;s2++)
-			    sum += Q(s1,s2) * fmask[s2];
-			R[m*n_states + s1] = sum;
-		    }
-		}
-	    }
-	    else
-		element_assign(R, matrix_size, 1);
+	    LCB->reference.reset(new Likelihood_Cache_Branch(L0, n_models, n_states));
+	    LCB->reference->bits = mask;
+	    LCB->reference->patterns = LCB->patterns;
 	}
 
-	LCB->other_subst = 1;
+	if (LCB->single_precision())
+	    peel_leaf_branch<float>(sequence, a, transition_P, LCB);
+	else
+	    peel_leaf_branch<double>(sequence, a, transition_P, LCB);
+
+	if (LCB->reference)
+	    peel_leaf_branch<double>(sequence, a, transition_P, LCB->reference.get());
 
 	return LCB;
     }
@@ -1007,33 +1126,237 @@ namespace substitution {
     }
 	
 
-    Likelihood_Cache_Branch*
-    peel_internal_branch(const Likelihood_Cache_Branch* LCB1,
-			 const Likelihood_Cache_Branch* LCB2,
-			 const pairwise_alignment_t& A0,
-			 const pairwise_alignment_t& A1,
-			 const EVector& transition_P,
-			 const Matrix& F)
+    /// Rescale column R, whose largest entry is max_R, if it is in danger of underflowing.  Return the number of times it was rescaled.
+    inline int rescale_column(double* R, int matrix_size, double max_R)
     {
-	total_peel_internal_branches++;
+	if (max_R >= scale_min) return 0;
 
-	const int n_models = transition_P.size();
-	const int n_states = transition_P[0].as_<Box<Matrix>>().size1();
-	const int matrix_size = n_models * n_states;
+	for(int j=0; j<matrix_size; j++)
+	    R[j] *= scale_factor;
+	return 1;
+    }
+
+    // Single-precision columns are multiplied by a power of two that brings their largest entry into [1/2,1),
+    // so that small entries are not flushed to zero until they are about 2^-125 times the largest one.
+    inline int rescale_column(float* R, int matrix_size, float max_R)
+    {
+	if (max_R >= scale_min_float or max_R <= 0) return 0;
+
+	int e;
+	std::frexp(max_R, &e);
+	const float factor = std::ldexp(1.0f, -e);
+	for(int j=0; j<matrix_size; j++)
+	    R[j] *= factor;
+	return -e;
+    }
+
+    /// Single-precision columns whose largest entry is below this before rescaling are recomputed in double precision.
+    ///
+    /// Entries below about 2^-126 are flushed to zero, so this keeps at least 2^-66 of room below the largest
+    /// entry of a column, even when the two subtrees behind it strongly disagree.
+    constexpr float min_max_float = 1.0e-18f;
+
+    /// Recompute column c of LCB3 from the columns of LCB1 and LCB2 behind it in double precision, and store it in single precision.
+    void peel_column_double(const Likelihood_Cache_Branch* LCB1,
+			    const Likelihood_Cache_Branch* LCB2,
+			    Likelihood_Cache_Branch* LCB3,
+			    const matrix<int>& index,
+			    int c,
+			    const transposed_transition_matrices& QT)
+    {
+	const int matrix_size = LCB3->matrix_size();
+	vector<double> S(matrix_size, 1.0);
+	vector<double> R(matrix_size);
+
+	int scale = 0;
+	int i1 = index(c,0);
+	int i2 = index(c,1);
+	if (i1 >= 0)
+	{
+	    element_prod_modify(S.data(), *LCB1, i1);
+	    scale += LCB1->scale(i1);
+	}
+	if (i2 >= 0)
+	{
+	    element_prod_modify(S.data(), *LCB2, i2);
+	    scale += LCB2->scale(i2);
+	}
+
+	double max_R = propagate(R.data(), S.data(), QT);
+
+	// Bring the largest entry into [1/2,1) before converting to single precision.
+	int e = 0;
+	if (max_R > 0)
+	    std::frexp(max_R, &e);
+	float* out = LCB3->column<float>(c);
+	for(int j=0;j<matrix_size;j++)
+	    out[j] = std::ldexp(R[j], -e);
+	LCB3->scale(c) = scale - e;
+    }
+
+    /// Rescale column c of LCB3, whose largest entry is max_R, if it is in danger of underflowing.
+    void finish_column(const Likelihood_Cache_Branch*, const Likelihood_Cache_Branch*, Likelihood_Cache_Branch* LCB3,
+		       const matrix<int>&, int c, double max_R, const transposed_transition_matrices*)
+    {
+	LCB3->scale(c) += rescale_column(LCB3->column<double>(c), LCB3->matrix_size(), max_R);
+    }
+
+    /// Rescale column c of LCB3, whose largest entry is max_R, or recompute it in double precision if
+    /// single precision may have flushed entries to zero that are not negligible.
+    void finish_column(const Likelihood_Cache_Branch* LCB1, const Likelihood_Cache_Branch* LCB2, Likelihood_Cache_Branch* LCB3,
+		       const matrix<int>& index, int c, float max_R, const transposed_transition_matrices* QT_double)
+    {
+	if (max_R < min_max_float)
+	{
+	    total_double_columns++;
+	    peel_column_double(LCB1, LCB2, LCB3, index, c, *QT_double);
+	}
+	else
+	    LCB3->scale(c) += rescale_column(LCB3->column<float>(c), LCB3->matrix_size(), max_R);
+    }
+
+    /// Propagate columns [c1,c2) of LCB3 from the source distributions in the rows of X, and rescale them if necessary.
+    template <typename T>
+    void propagate_columns(const Likelihood_Cache_Branch* LCB1,
+			   const Likelihood_Cache_Branch* LCB2,
+			   Likelihood_Cache_Branch* LCB3,
+			   const matrix<int>& index,
+			   int c1, int c2,
+			   const T* X,
+			   const basic_transposed_transition_matrices<T>& QT,
+			   const transposed_transition_matrices* QT_double)
+    {
+	const int matrix_size = LCB3->matrix_size();
+
+	propagate_block(LCB3->column<T>(c1), X, c2-c1, QT);
+
+	for(int c=c1;c<c2;c++)
+	    finish_column(LCB1, LCB2, LCB3, index, c, element_max(LCB3->column<T>(c), matrix_size), QT_double);
+    }
+
+    /// Compute LCB3 from the LCBs in inputs by calling peel( ) on the worker pool, or immediately if there are no worker threads.
+    void peel_async(Likelihood_Cache_Branch* LCB3, const vector<const Likelihood_Cache_Branch*>& inputs, std::function<void()> peel)
+    {
+	if (worker_pool().n_workers() == 0)
+	{
+	    peel();
+	    return;
+	}
+
+	// The inputs must stay alive until the task is done with them.
+	for(auto LCB: inputs)
+	    LCB->add_reader();
+	LCB3->start_async();
+
+	worker_pool().submit([LCB3,inputs,peel]
+			     {
+				 for(auto LCB: inputs)
+				     LCB->wait();
+				 peel();
+				 for(auto LCB: inputs)
+				     LCB->remove_reader();
+				 LCB3->finish_async();
+			     });
+    }
+
+    /// Compute columns [c1,c2) of LCB3, where index(c,0) and index(c,1) are the columns of LCB1 and LCB2 behind column c (or -1).
+    ///
+    /// Each column only depends on its own sources, so different ranges may be computed on different threads.
+    /// When peeling in single precision, QT_double is used to recompute columns that single precision cannot represent.
+    template <typename T>
+    void peel_indexed_columns(const Likelihood_Cache_Branch* LCB1,
+			      const Likelihood_Cache_Branch* LCB2,
+			      Likelihood_Cache_Branch* LCB3,
+			      const matrix<int>& index,
+			      int c1, int c2,
+			      const basic_transposed_transition_matrices<T>& QT,
+			      const transposed_transition_matrices* QT_double)
+    {
+	const int matrix_size = LCB3->matrix_size();
+
+	// For large state spaces, collect the source distributions for a block of columns
+	// and propagate them all at once with a matrix-matrix product.
+	const bool use_blocks = (QT.n_states() >= min_states_for_block_peeling);
+
+	// scratch space: we cannot use LCB3->scratch( ) because other threads may be using it.
+	vector<T> buffer( (use_blocks ? std::min(peel_block_columns, c2-c1) : 1) * matrix_size );
+	int block_start = c1;
+
+	for(int c=c1;c<c2;c++)
+	{
+	    int i1 = index(c,0);
+	    int i2 = index(c,1);
+
+	    T* S = buffer.data() + (use_blocks ? (c-block_start)*matrix_size : 0);
+
+	    int scale = 0;
+	    const T* C = S;
+	    if (i1 >= 0 and i2 >= 0)
+	    {
+		element_prod_assign(S, LCB1->column<T>(i1), LCB2->column<T>(i2), matrix_size);
+		scale = LCB1->scale(i1) + LCB2->scale(i2);
+	    }
+	    else if (i1 >= 0)
+	    {
+		C = LCB1->column<T>(i1);
+		scale = LCB1->scale(i1);
+	    }
+	    else if (i2 >= 0)
+	    {
+		C = LCB2->column<T>(i2);
+		scale = LCB2->scale(i2);
+	    }
+	    else
+		element_assign(S, matrix_size, 1); // Columns like this would not be in subA_index_leaf, but might be in subA_index_internal
+
+	    LCB3->scale(c) = scale;
+
+	    if (use_blocks)
+	    {
+		// defer propagation until the block is full
+		if (C != S)
+		    element_assign(S, C, matrix_size);
+	    }
+	    else
+	    {
+		// propagate from the source distribution
+		T* R = LCB3->column<T>(c);            //name the result matrix
+		// compute the distribution at the target (parent) node - multiple letters
+		finish_column(LCB1, LCB2, LCB3, index, c, propagate(R, C, QT), QT_double);
+	    }
+
+	    if (use_blocks and c+1 - block_start == peel_block_columns)
+	    {
+		propagate_columns(LCB1, LCB2, LCB3, index, block_start, c+1, buffer.data(), QT, QT_double);
+		block_start = c+1;
+	    }
+	}
+	if (use_blocks and c2 > block_start)
+	    propagate_columns(LCB1, LCB2, LCB3, index, block_start, c2, buffer.data(), QT, QT_double);
+    }
+
+    template <typename T>
+    void peel_internal_branch(const Likelihood_Cache_Branch* LCB1,
+			      const Likelihood_Cache_Branch* LCB2,
+			      Likelihood_Cache_Branch* LCB3,
+			      const pairwise_alignment_t& A0,
+			      const pairwise_alignment_t& A1,
+			      const basic_transposed_transition_matrices<T>& QT,
+			      const transposed_transition_matrices* QT_double,
+			      const Matrix& F)
+    {
+	const int matrix_size = QT.n_models() * QT.n_states();
 
 	// get the relationships with the sub-alignments for the (two) branches behind b0
 
-        // Do this before accessing matrices or other_subst
-	auto* LCB3 = new Likelihood_Cache_Branch(A0.length2(), n_models, n_states);
 	assert(A0.length2() == A1.length2());
 	assert(A0.length1() == LCB1->n_columns());
 	assert(A1.length1() == LCB2->n_columns());
 
-	// scratch matrix
-	double* S = LCB3->scratch(0);
-
-	Matrix ones(n_models, n_states);
-	element_assign(ones, 1);
+	// Find the columns of LCB1 and LCB2 behind each column of LCB3, and fold the
+	// columns that are not behind any column of LCB3 into other_subst.
+	const int L3 = LCB3->n_columns();
+	matrix<int> index(L3, 2);
 
 	log_prod total;
 	int total_scale = 0;
@@ -1045,20 +1368,20 @@ namespace substitution {
 	    while (i0 < AL0 and not A0.has_character2(i0))
 	    {
 		assert(A0.has_character1(i0));
-		double p_col = element_prod_sum(F.begin(), (*LCB1)[s0], matrix_size );
+		double p_col = element_prod_sum(F.begin(), LCB1->column<T>(s0), matrix_size );
 		assert(0 <= p_col and p_col <= 1.00000000001);
 		total.mult_with_count(p_col,(*LCB1).count(s0));
-		total_scale += LCB1->scale(s0);
+		total_scale += (*LCB1).count(s0) * LCB1->scale(s0);
 		i0++;
 		s0++;
 	    }
 	    while (i1 < AL1 and not A1.has_character2(i1))
 	    {
 		assert(A1.has_character1(i1));
-		double p_col = element_prod_sum(F.begin(), (*LCB2)[s1], matrix_size );
+		double p_col = element_prod_sum(F.begin(), LCB2->column<T>(s1), matrix_size );
 		assert(0 <= p_col and p_col <= 1.00000000001);
 		total.mult_with_count(p_col,(*LCB2).count(s1));
-		total_scale += LCB2->scale(s1);
+		total_scale += (*LCB2).count(s1) * LCB2->scale(s1);
 		i1++;
 		s1++;
 	    }
@@ -1073,162 +1396,212 @@ namespace substitution {
 		assert(A0.has_character2(i0) and A1.has_character2(i1));
 	    }
 
-	    int scale = 0;
-	    const double* C = S;
 	    bool not_gap0 = A0.has_character1(i0);
 	    bool not_gap1 = A1.has_character1(i1);
 	    i0++;
 	    i1++;
-	    int count = -1;
-	    if (not_gap0 and not_gap1)
-	    {
-		element_prod_assign(S, (*LCB1)[s0], (*LCB2)[s1], matrix_size);
-		scale = LCB1->scale(s0) + LCB2->scale(s1);
-		count = (*LCB1).count(s0);
-		assert(count == (*LCB2).count(s1));
-		s0++;
-		s1++;
-	    }
-	    else if (not_gap0)
+	    int count = 1;
+	    index(s2,0) = -1;
+	    index(s2,1) = -1;
+	    if (not_gap0)
 	    {
-		C = (*LCB1)[s0];
-		scale = LCB1->scale(s0);
 		count = (*LCB1).count(s0);
-		s0++;
+		index(s2,0) = s0++;
 	    }
-	    else if (not_gap1)
+	    if (not_gap1)
 	    {
-		C = (*LCB2)[s1];
-		scale = LCB2->scale(s1);
+		assert(not not_gap0 or count == (*LCB2).count(s1));
 		count = (*LCB2).count(s1);
-		s1++;
-	    }
-	    else
-	    {
-		count = 1;
-		C = ones.begin();  // Columns like this would not be in subA_index_leaf, but might be in subA_index_internal
-	    }
-
-	    // propagate from the source distribution
-	    double* R = (*LCB3)[s2];            //name the result matrix
-	    bool need_scale = true;
-	    for(int m=0;m<n_models;m++)
-	    {
-		const Matrix& Q = transition_P[m].as_<Box<Matrix>>();
-	
-		// compute the distribution at the target (parent) node - multiple letters
-		for(int s1=0;s1<n_states;s1++) {
-		    double temp=0;
-		    for(int s2=0;s2<n_states;s2++)
-			temp += Q(s1,s2)*C[m*n_states + s2];
-		    R[m*n_states + s1] = temp;
-		    need_scale = need_scale and (temp < scale_min);
-		}
-	    }
-	    if (need_scale) // and false)
-	    {
-		scale++;
-		for(int j=0; j<matrix_size; j++)
-		    R[j] *= scale_factor;
+		index(s2,1) = s1++;
 	    }
-	    LCB3->scale(s2) = scale;
 	    assert(count >= 1);
 	    LCB3->count(s2) = count;
 	    s2++;
 	}
+	assert(s2 == L3);
+
+	for_column_chunks(L3, [&](int c1, int c2) {peel_indexed_columns(LCB1, LCB2, LCB3, index, c1, c2, QT, QT_double);});
 
 	LCB3->other_subst = LCB1->other_subst * LCB2->other_subst * total;
-	LCB3->other_subst.log() += total_scale*log_scale_min;
-	return LCB3;
+	LCB3->other_subst.log() += total_scale*log_scale_min_for<T>();
     }
 
     Likelihood_Cache_Branch*
-    peel_internal_branch_SEV(const Likelihood_Cache_Branch* LCB1,
-			     const Likelihood_Cache_Branch* LCB2,
-			     const EVector& transition_P,
-			     const Matrix& /*F*/)
+    peel_internal_branch(const Likelihood_Cache_Branch* LCB1,
+			 const Likelihood_Cache_Branch* LCB2,
+			 const pairwise_alignment_t& A0,
+			 const pairwise_alignment_t& A1,
+			 const EVector& transition_P,
+			 const Matrix& F)
     {
 	total_peel_internal_branches++;
 
 	const int n_models = transition_P.size();
 	const int n_states = transition_P[0].as_<Box<Matrix>>().size1();
-	const int matrix_size = n_models * n_states;
-    
-	const auto& bits1 = LCB1->bits;
-	const auto& bits2 = LCB2->bits;
 
-	int L = bits1.size();
-	assert(L > 0);
-	assert(bits2.size() == L);
+	assert(LCB1->single_precision() == LCB2->single_precision());
+	const bool single = LCB1->single_precision();
 
-	// Do this before accessing matrices or other_subst
-	auto* LCB3 = new Likelihood_Cache_Branch(L, n_models, n_states);
-	LCB3->bits = LCB1->bits | LCB2->bits;
-	const auto& bits3 = LCB3->bits;
-	assert(bits3.size() == L);
+        // Do this before accessing matrices or other_subst
+	auto* LCB3 = new Likelihood_Cache_Branch(A0.length2(), n_models, n_states, single);
+	if (LCB1->reference)
+	    LCB3->reference.reset(new Likelihood_Cache_Branch(A0.length2(), n_models, n_states));
+
+	// Single-precision peeling also needs the double-precision matrices, to recompute columns that it cannot represent.
+	transposed_transition_matrices QT(transition_P);
+	transposed_transition_matrices_float QTf;
+	if (single)
+	    QTf = transposed_transition_matrices_float(transition_P);
+
+	// Copy the arguments that the task uses, since the originals may be freed before it runs.
+	peel_async(LCB3, {LCB1, LCB2},
+		   [LCB1, LCB2, LCB3, A0, A1, QT = std::move(QT), QTf = std::move(QTf), F]
+		   {
+		       if (LCB3->single_precision())
+			   peel_internal_branch(LCB1, LCB2, LCB3, A0, A1, QTf, &QT, F);
+		       else
+			   peel_internal_branch(LCB1, LCB2, LCB3, A0, A1, QT, nullptr, F);
+
+		       if (LCB3->reference)
+			   peel_internal_branch(LCB1->reference.get(), LCB2->reference.get(), LCB3->reference.get(), A0, A1, QT, nullptr, F);
+		   });
 
-	// scratch matrix
-	double* S = LCB3->scratch(0);
+	return LCB3;
+    }
 
-	for(int c=0,i1=0,i2=0,i3=0;c<L;c++)
+    /// The largest table of pairs of child patterns that we use to find the subtree patterns of an SEV branch.
+    constexpr int max_pattern_pairs = 1024;
+
+    /// The number of distinct subtree patterns in the columns of an SEV branch.
+    int n_patterns(const Likelihood_Cache_Branch& LCB)
+    {
+	if (LCB.patterns.empty()) return 0;
+	return *std::max_element(LCB.patterns.begin(), LCB.patterns.end()) + 1;
+    }
+
+    template <typename T>
+    void peel_internal_branch_SEV(const Likelihood_Cache_Branch* LCB1,
+				  const Likelihood_Cache_Branch* LCB2,
+				  Likelihood_Cache_Branch* LCB3,
+				  const basic_transposed_transition_matrices<T>& QT,
+				  const transposed_transition_matrices* QT_double)
+    {
+	const auto& bits1 = LCB1->bits;
+	const auto& bits2 = LCB2->bits;
+	const auto& bits3 = LCB3->bits;
+
+	const int L = bits3.size();
+
+	// The subtree pattern of a column of LCB3 is determined by the patterns of the columns
+	// of LCB1 and LCB2 behind it.  For each new pattern, record the first columns of LCB1
+	// and LCB2 that have it.
+	auto& patterns3 = LCB3->patterns;
+	patterns3.clear();
+	patterns3.reserve(L);
+
+	// Look up pairs of patterns in a table.  If there are too many possible pairs, then
+	// the columns are probably nearly all different, so we just give each one its own pattern.
+	const int N2 = n_patterns(*LCB2) + 1;
+	const std::int64_t n_pairs = std::int64_t(n_patterns(*LCB1) + 1) * N2;
+	const bool find_patterns = (n_pairs <= std::max(4*L, max_pattern_pairs));
+	vector<int> pair_table(find_patterns ? n_pairs : 0, -1);
+
+	matrix<int> index(LCB3->n_columns(), 2);
+	int n_patterns3 = 0;
+	for(int c=0,i1=0,i2=0;c<L;c++)
 	{
 	    if (not bits3.test(c)) continue;
 
 	    bool nongap1 = bits1.test(c);
 	    bool nongap2 = bits2.test(c);
 
-	    int scale = 0;
-	    const double* C = S;
-	    if (nongap1 and nongap2)
-	    {
-		element_prod_assign(S, (*LCB1)[i1], (*LCB2)[i2], matrix_size);
-		scale = LCB1->scale(i1) + LCB2->scale(i2);
-	    }
-	    else if (nongap1)
-	    {
-		C = (*LCB1)[i1];
-		scale = LCB1->scale(i1);
-	    }
-	    else if (nongap2)
-	    {
-		C = (*LCB2)[i2];
-		scale = LCB2->scale(i2);
-	    }
-	    else
-	    {
-		// columns like this should not be in the index
-		std::abort();
-	    }
+	    // columns like this should not be in the index
+	    if (not nongap1 and not nongap2) std::abort();
 
-	    // propagate from the source distribution
-	    double* R = (*LCB3)[i3];            //name the result matrix
-	    bool need_scale = true;
-	    for(int m=0;m<n_models;m++)
+	    int p3 = n_patterns3;
+	    if (find_patterns)
 	    {
-		const Matrix& Q = transition_P[m].as_<Box<Matrix>>();
-	
-		// compute the distribution at the target (parent) node - multiple letters
-		for(int s1=0;s1<n_states;s1++) {
-		    double temp=0;
-		    for(int s2=0;s2<n_states;s2++)
-			temp += Q(s1,s2)*C[m*n_states + s2];
-		    R[m*n_states + s1] = temp;
-		    need_scale = need_scale and (temp < scale_min);
-		}
+		int p1 = nongap1 ? LCB1->patterns[i1] : -1;
+		int p2 = nongap2 ? LCB2->patterns[i2] : -1;
+		int& p = pair_table[(p1+1)*N2 + (p2+1)];
+		if (p < 0) p = n_patterns3;
+		p3 = p;
 	    }
-	    if (need_scale) // and false)
+
+	    if (p3 == n_patterns3)
 	    {
-		scale++;
-		for(int j=0; j<matrix_size; j++)
-		    R[j] *= scale_factor;
+		index(p3,0) = nongap1 ? i1 : -1;
+		index(p3,1) = nongap2 ? i2 : -1;
+		n_patterns3++;
 	    }
-	    LCB3->scale(i2) = scale;
+	    patterns3.push_back(p3);
 
 	    if (nongap1) i1++;
 	    if (nongap2) i2++;
-	    i3++;
 	}
 
+	// Only peel one column for each pattern, into the first n_patterns3 columns.
+	for_column_chunks(n_patterns3, [&](int c1, int c2) {peel_indexed_columns(LCB1, LCB2, LCB3, index, c1, c2, QT, QT_double);});
+
+	// Then copy pattern p into every column that has it.  Pattern p first appears in a column >= p,
+	// so working backwards we never overwrite a pattern that we still need.
+	const int matrix_size = LCB3->matrix_size();
+	for(int c=int(patterns3.size())-1;c>=0;c--)
+	{
+	    int p = patterns3[c];
+	    assert(p <= c);
+	    if (p == c) continue;
+	    std::copy_n(LCB3->column<T>(p), matrix_size, LCB3->column<T>(c));
+	    LCB3->scale(c) = LCB3->scale(p);
+	}
+    }
+
+    Likelihood_Cache_Branch*
+    peel_internal_branch_SEV(const Likelihood_Cache_Branch* LCB1,
+			     const Likelihood_Cache_Branch* LCB2,
+			     const EVector& transition_P,
+			     const Matrix& /*F*/)
+    {
+	total_peel_internal_branches++;
+
+	const int n_models = transition_P.size();
+	const int n_states = transition_P[0].as_<Box<Matrix>>().size1();
+
+	int L = LCB1->bits.size();
+	assert(L > 0);
+	assert(LCB2->bits.size() == L);
+
+	assert(LCB1->single_precision() == LCB2->single_precision());
+	const bool single = LCB1->single_precision();
+
+	// Do this before accessing matrices or other_subst
+	auto* LCB3 = new Likelihood_Cache_Branch(L, n_models, n_states, single);
+	LCB3->bits = LCB1->bits | LCB2->bits;
+	assert(LCB3->bits.size() == L);
+	if (LCB1->reference)
+	{
+	    LCB3->reference.reset(new Likelihood_Cache_Branch(L, n_models, n_states));
+	    LCB3->reference->bits = LCB3->bits;
+	}
+
+	// Single-precision peeling also needs the double-precision matrices, to recompute columns that it cannot represent.
+	transposed_transition_matrices QT(transition_P);
+	transposed_transition_matrices_float QTf;
+	if (single)
+	    QTf = transposed_transition_matrices_float(transition_P);
+
+	peel_async(LCB3, {LCB1, LCB2},
+		   [LCB1, LCB2, LCB3, QT = std::move(QT), QTf = std::move(QTf)]
+		   {
+		       if (LCB3->single_precision())
+			   peel_internal_branch_SEV(LCB1, LCB2, LCB3, QTf, &QT);
+		       else
+			   peel_internal_branch_SEV(LCB1, LCB2, LCB3, QT, nullptr);
+
+		       if (LCB3->reference)
+			   peel_internal_branch_SEV(LCB1->reference.get(), LCB2->reference.get(), LCB3->reference.get(), QT, nullptr);
+		   });
+
 	return LCB3;
     }
   
@@ -1443,14 +1816,28 @@ namespace substitution {
 	    // Note that we could do ZERO products in this loop
 	    auto m = LCB[i+delta];
 	    int scale = 0;
+	    int float_scale = 0;
 	    for(int j=0;j<b.size();j++) 
 	    {
 		int i0 = index(i,j);
 		if (i0 == alphabet::gap) continue;
 
-		element_prod_modify(m, (*cache[j])[i0], matrix_size);
-		scale += cache[j]->scale(i0);
+		element_prod_modify(m, *cache[j], i0);
+		if (cache[j]->single_precision())
+		    float_scale += cache[j]->scale(i0);
+		else
+		    scale += cache[j]->scale(i0);
 	    }
+
+	    // Convert single-precision scale factors to double-precision ones, and divide out the remainder directly.
+	    scale += float_scale / float_scales_per_scale;
+	    if (int remainder = float_scale % float_scales_per_scale)
+	    {
+		double factor = std::ldexp(1.0, -remainder);
+		for(int s=0;s<matrix_size;s++)
+		    m[s] *= factor;
+	    }
+
 	    LCB.scale(i) = scale;
 	}
 
@@ -1580,7 +1967,6 @@ namespace substitution {
 
 	const int n_models = P.n_base_models();
 	const int n_states = P.n_states();
-	const int matrix_size = n_models * n_states;
 
 	// scratch matrix 
 	Matrix S(n_models, n_states);
@@ -1629,9 +2015,9 @@ namespace substitution {
 
 		S = F;
 
-		if (i0 != -1) element_prod_modify(S.begin(), cache0[i0], matrix_size);
-		if (i1 != -1) element_prod_modify(S.begin(), cache1[i1], matrix_size);
-		if (i2 != -1) element_prod_modify(S.begin(), cache2[i2], matrix_size);
+		if (i0 != -1) element_prod_modify(S.begin(), cache0, i0);
+		if (i1 != -1) element_prod_modify(S.begin(), cache1, i1);
+		if (i2 != -1) element_prod_modify(S.begin(), cache2, i2);
 
 		pair<int,int> state_model = sample(S);
 
@@ -1699,8 +2085,8 @@ namespace substitution {
 		    calc_transition_prob_from_parent(S, ancestral_characters[node][i], transition_P, F);
 
 		    // We need child branch CLVs, since we save CLVs and the end of each branch.
-		    if (i1 != -1) element_prod_modify(S.begin(), cache1[i1], matrix_size);
-		    if (i2 != -1) element_prod_modify(S.begin(), cache2[i2], matrix_size);
+		    if (i1 != -1) element_prod_modify(S.begin(), cache1, i1);
+		    if (i2 != -1) element_prod_modify(S.begin(), cache2, i2);
 
 		    pair<int,int> state_model = sample(S);
 
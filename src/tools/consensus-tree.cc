@@ -46,9 +46,9 @@ void add_partitions_and_counts(const vector<tree_sample>& samples, int index, ma
 
     typedef map<dynamic_bitset<>,p_counts> container_t;
 
-    for(int i=0;i<sample.trees.size();i++) 
+    for(int i=0;i<sample.trees().size();i++) 
     {
-	const vector<dynamic_bitset<> >& T = sample.trees[i].partitions;
+	const vector<dynamic_bitset<> >& T = sample.trees()[i].partitions;
 
 	// for each partition in the next tree
 	dynamic_bitset<> partition(names.size());
@@ -107,7 +107,7 @@ get_partition_counts_and_lengths(const tree_sample& sample)
 
     vector<string> names = sample.names();
     const int L = names.size();
-    const int N = sample.trees.size();
+    const int N = sample.trees().size();
 
     // Setup: add leaf branch records and store references to them
     vector<container_t::iterator> leaf_branch_records;
@@ -127,9 +127,9 @@ get_partition_counts_and_lengths(const tree_sample& sample)
     }
 
     // Main loop: iterate over all trees
-    for(int i=0;i<sample.trees.size();i++) 
+    for(int i=0;i<sample.trees().size();i++) 
     {
-	const tree_record& T = sample.trees[i];
+	const tree_record& T = sample.trees()[i];
 
 	// for each INTERNAL partition in the next tree
 	for(int b=0;b<L;b++) {
@@ -191,9 +191,9 @@ get_Ml_partitions_and_counts(const tree_sample& sample,double l,const dynamic_bi
 
     unsigned count = 0;
 
-    for(int i=0;i<sample.trees.size();i++) 
+    for(int i=0;i<sample.trees().size();i++) 
     {
-	const vector<dynamic_bitset<> >& T = sample.trees[i].partitions;
+	const vector<dynamic_bitset<> >& T = sample.trees()[i].partitions;
 
 	unsigned min_old = std::min(1+(unsigned)(l*count),count);
 
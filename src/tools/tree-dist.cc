@@ -70,58 +70,102 @@ bool operator>(const tree_record& t1, const tree_record& t2)
 
 SequenceTree tree_sample::T(int i) const 
 {
-    return get_mf_tree(leaf_names,trees[i].partitions, trees[i].branch_lengths);
+    return get_mf_tree(leaf_names,trees_[i].partitions, trees_[i].branch_lengths);
+}
+
+std::size_t hash_bitset::operator()(const dynamic_bitset<>& b) const
+{
+    vector<dynamic_bitset<>::block_type> blocks(b.num_blocks());
+    boost::to_block_range(b, blocks.begin());
+
+    // FNV-1a over the blocks.
+    std::uint64_t h = 14695981039346656037ULL;
+    for(auto block: blocks)
+	h = (h ^ block) * 1099511628211ULL;
+    return h;
+}
+
+void tree_sample::index_tree(int t)
+{
+    for(auto& split: trees_[t].partitions)
+	split_index[split].push_back(t);
+}
+
+void tree_sample::rebuild_split_index()
+{
+    split_index.clear();
+    for(int t=0;t<trees_.size();t++)
+	index_tree(t);
+}
+
+dynamic_bitset<> tree_sample::trees_with_split(const dynamic_bitset<>& s) const
+{
+    dynamic_bitset<> result(size());
+
+    auto record = split_index.find(s);
+    if (record != split_index.end())
+	for(int t: record->second)
+	    result.set(t);
+
+    return result;
+}
+
+dynamic_bitset<> tree_sample::trees_implying(const partition& p) const
+{
+    // A full partition is only implied by the identical split, which is stored with leaf 0 in the mask.
+    if (p.full())
+	return trees_with_split(p.group1[0] ? p.group1 : p.group2);
+
+    // A partial partition may be implied by several different splits.
+    dynamic_bitset<> result(size());
+    for(auto& record: split_index)
+	if (implies(record.first, p))
+	    for(int t: record.second)
+		result.set(t);
+    return result;
+}
+
+dynamic_bitset<> tree_sample::trees_implying(const vector<partition>& partitions) const
+{
+    dynamic_bitset<> result(size());
+    result.set();
+
+    for(int i=0;i<partitions.size() and result.any();i++)
+	result &= trees_implying(partitions[i]);
+
+    return result;
 }
 
 valarray<bool> tree_sample::support(const partition& p) const 
 {
-    valarray<bool> result(size());
+    auto in_trees = trees_implying(p);
 
+    valarray<bool> result(size());
     for(int i=0;i<result.size();i++) 
-    {
-	// Get a tree with the same topology
-	const vector<dynamic_bitset<> > & T = trees[i].partitions;
-    
-	result[i] = implies(T,p);
-    }
+	result[i] = in_trees[i];
     return result;
 }
 
 valarray<bool> tree_sample::support(const vector<partition>& partitions) const 
 {
-    valarray<bool> result(size());
-
     vector<partition> informative_partitions = select(partitions,informative);
 
+    auto in_trees = trees_implying(informative_partitions);
+
+    valarray<bool> result(size());
     for(int i=0;i<result.size();i++) 
-    {
-	// Get a tree with the same topology
-	const vector<dynamic_bitset<> >& T = trees[i].partitions;
-    
-	result[i] = implies(T,informative_partitions);
-    }
+	result[i] = in_trees[i];
     return result;
 }
 
 unsigned tree_sample::count(const partition& P) const 
 {
-    unsigned count=0;
-    for(int t=0;t<trees.size();t++) 
-	if (implies(trees[t].partitions,P))
-	    count ++;
-   
-    return count;
+    return trees_implying(P).count();
 }
 
 unsigned tree_sample::count(const vector<partition>& partitions) const 
 {
-    unsigned count=0;
-    for(int t=0;t<trees.size();t++) {
-	if (implies(trees[t].partitions,partitions))
-	    count ++;
-    }
-   
-    return count;
+    return trees_implying(partitions).count();
 }
 
 double tree_sample::PP(const partition& P) const 
@@ -134,6 +178,29 @@ double tree_sample::PP(const vector<partition>& partitions) const
     return double(count(partitions))/size();
 }
 
+namespace
+{
+    // The SplitMix64 finalizer: a fixed, well-mixed key for each leaf.
+    std::uint64_t leaf_key(std::uint64_t x)
+    {
+	x += 0x9e3779b97f4a7c15ULL;
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+	return x ^ (x >> 31);
+    }
+}
+
+split_fingerprint fingerprint(const dynamic_bitset<>& split)
+{
+    split_fingerprint f;
+    for(auto i = split.find_first(); i != dynamic_bitset<>::npos; i = split.find_next(i))
+    {
+	f.h1 ^= leaf_key(2*i);
+	f.h2 ^= leaf_key(2*i+1);
+    }
+    return f;
+}
+
 tree_record::tree_record(const Tree& T)
     :n_leaves_(T.n_leaves()),
      partitions(T.n_branches()-T.n_leafbranches()),
@@ -168,12 +235,24 @@ tree_record::tree_record(const Tree& T)
 	else
 	    branch_lengths[i] = 1.0;
     }
+
+    for(auto& split: partitions)
+	split_fingerprints.push_back(fingerprint(split));
+    std::sort(split_fingerprints.begin(), split_fingerprints.end());
 }
 
 
 void tree_sample::add_tree(const tree_record& T)
 {
-    trees.push_back(T);
+    trees_.push_back(T);
+    index_tree(trees_.size()-1);
+}
+
+void tree_sample::remove_first(int n)
+{
+    assert(0 <= n and n <= trees_.size());
+    trees_.erase(trees_.begin(), trees_.begin() + n);
+    rebuild_split_index();
 }
 
 void tree_sample::add_tree(Tree& T)
@@ -250,7 +329,7 @@ int tree_sample::load_file(istream& file, int skip, optional<int> last, int subs
     //------------------- Process Trees --------------------//
     RootedTree T;
     int t=0;
-    int old_size = trees.size();
+    int old_size = trees_.size();
     while (trees_in->next_tree(T)) {
 	add_tree(T);
 	t++;
@@ -258,7 +337,7 @@ int tree_sample::load_file(istream& file, int skip, optional<int> last, int subs
 
     if (max and t > *max)
     {
-	assert(trees.size() == old_size + t);
+	assert(trees_.size() == old_size + t);
 
 	double N = t;
 	double n = *max;
@@ -268,12 +347,13 @@ int tree_sample::load_file(istream& file, int skip, optional<int> last, int subs
 	for(int i=0;i<n;i++)
 	{
 	    int i2 = floor(old_size + 0.5 + i*inc);
-	    trees2.push_back(std::move(trees[i2]));
+	    trees2.push_back(std::move(trees_[i2]));
 	}
-	trees.erase(trees.begin()+old_size,trees.end());
-	assert(trees.size() == old_size);
-	trees.insert(trees.end(), make_move_iterator(trees2.begin()), make_move_iterator(trees2.end()));
-	assert(trees.size() == old_size + n);
+	trees_.erase(trees_.begin()+old_size,trees_.end());
+	assert(trees_.size() == old_size);
+	trees_.insert(trees_.end(), make_move_iterator(trees2.begin()), make_move_iterator(trees2.end()));
+	assert(trees_.size() == old_size + n);
+	rebuild_split_index();
     }
 
     if (size() == 0)
@@ -443,8 +523,8 @@ tree_sample read_trees(variables_map& args, const vector<string>& leaf_labels)
 
     for(int i=0;i<trees.size();i++) {
 	if (skip == 0 and skip_fraction > 0) {
-	    int my_skip = std::min<int>(min_skip, trees[i].trees.size());
-	    trees[i].trees.erase(trees[i].trees.begin(), trees[i].trees.begin() + my_skip);
+	    int my_skip = std::min<int>(min_skip, trees[i].size());
+	    trees[i].remove_first(my_skip);
 	}
 	tree_dist.append_trees(trees[i]);
     }
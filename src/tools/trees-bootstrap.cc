@@ -721,8 +721,8 @@ int main(int argc,char* argv[])
 	{
 	    tree_sample& trees = tree_dists.sample(i);
 	    if (skip == 0 and skip_fraction > 0) {
-		int my_skip = std::min<int>(min_skip, trees.trees.size());
-		trees.trees.erase(trees.trees.begin(), trees.trees.begin() + my_skip);
+		int my_skip = std::min<int>(min_skip, trees.size());
+		trees.remove_first(my_skip);
 	    }
 	}
 
@@ -33,6 +33,7 @@
 #include "tree/tree-util.H"
 #include "tree-dist.H"
 #include "rng.H"
+#include "util/thread-pool.H"
 
 #include <boost/program_options.hpp>
 #include "distance-report.H"
@@ -125,6 +126,7 @@ variables_map parse_cmd_line(int argc,char* argv[])
 	("max,m",value<int>(),"Thin tree samples down to this number of trees.")
 	("subsample,x",value<int>()->default_value(1),"factor by which to subsample")
 	("verbose,v","Output more log messages on stderr.")
+	("threads,j",value<int>()->default_value(1),"Number of threads to use.")
 	;
 
     options_description analysis("Analysis options");
@@ -132,6 +134,7 @@ variables_map parse_cmd_line(int argc,char* argv[])
 	("analysis", value<string>()->default_value("matrix"), "Analysis: matrix, autocorrelation, diameter, compare, convergence, converged.")
 	("metric", value<string>()->default_value("topology"),"Tree distance: topology, branch, internal-branch.")
 	("remove-duplicates","[matrix]: disallow zero distances  between points.")
+	("stream","[matrix]: write each row when it is computed, instead of storing the whole matrix.")
 	("max-lag",value<int>(),"[autocorrelation]: max lag to consider.")
 	("CI",value<double>()->default_value(0.95,"0.95"),"Confidence interval size.")
 	("converged",value<double>()->default_value(0.05,"0.05"),"Comma-separated quantiles of distance required for converged? (smaller is more strict).")
@@ -191,24 +194,82 @@ matrix<double> leaf_distances(const Tree& T)
     return D;
 }
 
+// Distances are computed in square tiles, so that each thread only reads a few trees at a time.
+const int distance_tile_size = 64;
+
 matrix<double> distances(const vector<tree_record>& trees, 
 			 tree_metric_fn metric_fn
     )
 {
-    matrix<double> D(trees.size(),trees.size());
+    const int N = trees.size();
+    matrix<double> D(N,N);
+
+    // The tiles on or below the diagonal.  The metrics are symmetric, so each of these tiles
+    // also fills in the transposed tile above the diagonal.
+    const int n_tiles = (N + distance_tile_size - 1)/distance_tile_size;
+    vector<std::pair<int,int>> tiles;
+    for(int ti=0;ti<n_tiles;ti++)
+	for(int tj=0;tj<=ti;tj++)
+	    tiles.push_back({ti,tj});
 
     // calculate the pairwise distances
-    for(int i=0;i<trees.size();i++) {
-	for(int j=0;j<i;j++)
+    worker_pool().parallel_for(tiles.size(), [&](int k)
+    {
+	int i1 = tiles[k].first * distance_tile_size;
+	int i2 = std::min(N, i1 + distance_tile_size);
+	int j1 = tiles[k].second * distance_tile_size;
+	int j2 = std::min(N, j1 + distance_tile_size);
+
+	for(int i=i1;i<i2;i++)
 	{
-	    D(i,j) = D(j,i) = metric_fn(trees[i],trees[j]);
-	    assert(D(i,j) == metric_fn(trees[j],trees[i]));
+	    for(int j=j1;j<j2 and j<i;j++)
+		D(i,j) = D(j,i) = metric_fn(trees[i],trees[j]);
+	    if (j1 <= i and i < j2)
+		D(i,i) = 0;
 	}
-	D(i,i) = 0;
-    }
+    });
+
     return D;
 }
 
+/// Write the distance matrix row by row, without storing the whole matrix.
+///
+/// Each block of rows is computed on the worker threads and written before the next block is
+/// started.  Since the rows above the diagonal are not kept, every distance is computed twice.
+void write_distances(std::ostream& o,
+		     const vector<tree_record>& trees,
+		     tree_metric_fn metric_fn,
+		     optional<double> jitter
+    )
+{
+    const int N = trees.size();
+    const int block_size = std::max(distance_tile_size, 4*n_threads());
+
+    vector<vector<double>> rows;
+    for(int i1=0;i1<N;i1+=block_size)
+    {
+	int i2 = std::min(N, i1 + block_size);
+	rows.resize(i2-i1);
+
+	worker_pool().parallel_for(i2-i1, [&](int k)
+	{
+	    int i = i1 + k;
+	    auto& row = rows[k];
+	    row.resize(N);
+	    for(int j=0;j<N;j++)
+		row[j] = (i == j) ? 0 : metric_fn(trees[i],trees[j]);
+	});
+
+	for(auto& row: rows)
+	{
+	    if (jitter)
+		for(auto& d: row)
+		    d += gaussian(0,*jitter);
+	    o<<join(row,'\t')<<'\n';
+	}
+    }
+}
+
 double distance(const tree_record& T, 
 		const vector<tree_record>& trees,
 		tree_metric_fn metric_fn
@@ -230,6 +291,9 @@ int topology_distance2(const tree_record& t1, const tree_record& t2)
     const unsigned n2 = t2.n_internal_branches();
 
     // Accumulate distances for T1 partitions
+    //  (Compare the sorted split fingerprints, which avoids comparing O(n)-bit bitsets.)
+    auto& f1 = t1.split_fingerprints;
+    auto& f2 = t2.split_fingerprints;
     unsigned shared=0;
 
     int i=0,j=0;
@@ -237,12 +301,12 @@ int topology_distance2(const tree_record& t1, const tree_record& t2)
 	if (i >= n1) break;
 	if (j >= n2) break;
 
-	if (t1.partitions[i] == t2.partitions[j]) {
+	if (f1[i] == f2[j]) {
 	    i++;
 	    j++;
 	    shared++;
 	}
-	else if (t1.partitions[i] < t2.partitions[j])
+	else if (f1[i] < f2[j])
 	    i++;
 	else
 	    j++;
@@ -662,6 +726,10 @@ int main(int argc,char* argv[])
 
 	string analysis = args["analysis"].as<string>();
 
+	if (args["threads"].as<int>() < 1)
+	    throw myexception()<<"--threads: the number of threads must be at least 1.";
+	set_n_threads(args["threads"].as<int>());
+
 	unsigned skip = args["skip"].as<unsigned>();
 
 	int subsample=args["subsample"].as<int>();
@@ -713,20 +781,36 @@ int main(int argc,char* argv[])
 		}
 	    }
 
-	    matrix<double> D = distances(all_trees,metric_fn);
-
-	    if (args.count("remove-duplicates"))
-		D = remove_duplicates(D);
+	    if (args.count("stream"))
+	    {
+		if (args.count("remove-duplicates"))
+		    throw myexception()<<"--remove-duplicates needs the whole matrix, and cannot be used with --stream.";
 
-	    if (args.count("jitter"))
+		optional<double> jitter;
+		if (args.count("jitter"))
+		{
+		    jitter = args["jitter"].as<double>();
+		    myrand_init();
+		}
+		write_distances(cout, all_trees, metric_fn, jitter);
+	    }
+	    else
 	    {
-		double sigma = args["jitter"].as<double>();
-		myrand_init();
-		for(int i=0;i<D.size1();i++)
-		    for(int j=0;j<D.size2();j++)
-			D(i,j) += gaussian(0,sigma);
+		matrix<double> D = distances(all_trees,metric_fn);
+
+		if (args.count("remove-duplicates"))
+		    D = remove_duplicates(D);
+
+		if (args.count("jitter"))
+		{
+		    double sigma = args["jitter"].as<double>();
+		    myrand_init();
+		    for(int i=0;i<D.size1();i++)
+			for(int j=0;j<D.size2();j++)
+			    D(i,j) += gaussian(0,sigma);
+		}
+		print_matrix(D,'\t','\n');
 	    }
-	    print_matrix(D,'\t','\n');
 	}
 
 	else if (analysis == "autocorrelation") 
@@ -0,0 +1,147 @@
+/*
+  Copyright (C) 2018 Benjamin Redelings
+
+  This file is part of BAli-Phy.
+
+  BAli-Phy is free software; you can redistribute it and/or modify it under
+  the terms of the GNU General Public License as published by the Free
+  Software Foundation; either version 2, or (at your option) any later
+  version.
+
+  BAli-Phy is distributed in the hope that it will be useful, but WITHOUT ANY
+  WARRANTY; without even the implied warranty of MERCHANTABILITY or
+  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+  for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with BAli-Phy; see the file COPYING.  If not see
+  <http://www.gnu.org/licenses/>.  */
+
+#include "util/async-writer.H"
+#include <set>
+
+using std::unique_lock;
+using std::mutex;
+using std::shared_ptr;
+using std::ostream;
+using std::string;
+
+typedef std::chrono::steady_clock clock_type;
+
+void async_writer::check_error()
+{
+    if (error)
+	std::rethrow_exception(error);
+}
+
+// Streams are written and flushed without holding the lock, so that the sampler can
+// keep queueing text while the writer waits on the filesystem.
+void async_writer::writer_loop()
+{
+    std::set<shared_ptr<ostream>> unflushed;
+    auto last_flush = clock_type::now();
+
+    unique_lock<mutex> lock(mutex_);
+    while(true)
+    {
+	auto have_work = [this]{return stopping or not queue.empty() or flushes_requested > flushes_done;};
+	if (unflushed.empty())
+	    changed.wait(lock, have_work);
+	else
+	    changed.wait_until(lock, last_flush + flush_interval, have_work);
+
+	std::deque<chunk> batch;
+	std::swap(batch, queue);
+	long request = flushes_requested;
+	bool stop = stopping;
+	lock.unlock();
+
+	std::size_t batch_bytes = 0;
+	for(auto& c: batch)
+	    batch_bytes += c.text.size();
+
+	try
+	{
+	    for(auto& c: batch)
+	    {
+		(*c.stream)<<c.text;
+		unflushed.insert(c.stream);
+	    }
+
+	    if (stop or request > flushes_done or clock_type::now() >= last_flush + flush_interval)
+	    {
+		for(auto& stream: unflushed)
+		    stream->flush();
+		unflushed.clear();
+		last_flush = clock_type::now();
+	    }
+	}
+	catch (...)
+	{
+	    unflushed.clear();
+	    lock.lock();
+	    if (not error)
+		error = std::current_exception();
+	    lock.unlock();
+	}
+
+	// Closing a file can block, so release the streams before taking the lock.
+	batch.clear();
+
+	lock.lock();
+	queued_bytes -= batch_bytes;
+	if (unflushed.empty())
+	    flushes_done = request;
+	changed.notify_all();
+
+	if (stop and queue.empty()) return;
+    }
+}
+
+void async_writer::write(const shared_ptr<ostream>& stream, string text)
+{
+    if (text.empty()) return;
+
+    unique_lock<mutex> lock(mutex_);
+    check_error();
+
+    // Always accept text if the queue is empty, even if it is larger than max_bytes.
+    changed.wait(lock, [&]{return error or queued_bytes == 0 or queued_bytes + text.size() <= max_bytes;});
+    check_error();
+
+    queued_bytes += text.size();
+    queue.push_back({stream, std::move(text)});
+    changed.notify_all();
+}
+
+void async_writer::flush()
+{
+    unique_lock<mutex> lock(mutex_);
+    long request = ++flushes_requested;
+    changed.notify_all();
+    changed.wait(lock, [&]{return error or flushes_done >= request;});
+    check_error();
+}
+
+async_writer::async_writer(std::size_t b, std::chrono::milliseconds t)
+    :max_bytes(b), flush_interval(t)
+{
+    writer = std::thread([this]{writer_loop();});
+}
+
+async_writer::~async_writer()
+{
+    {
+	unique_lock<mutex> lock(mutex_);
+	stopping = true;
+    }
+    changed.notify_all();
+    writer.join();
+}
+
+async_writer& log_writer()
+{
+    // Alignment samples for large data sets can be several megabytes each.
+    static async_writer writer(64*1024*1024, std::chrono::seconds(1));
+    return writer;
+}
@@ -0,0 +1,162 @@
+/*
+  Copyright (C) 2018 Benjamin Redelings
+
+  This file is part of BAli-Phy.
+
+  BAli-Phy is free software; you can redistribute it and/or modify it under
+  the terms of the GNU General Public License as published by the Free
+  Software Foundation; either version 2, or (at your option) any later
+  version.
+
+  BAli-Phy is distributed in the hope that it will be useful, but WITHOUT ANY
+  WARRANTY; without even the implied warranty of MERCHANTABILITY or
+  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+  for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with BAli-Phy; see the file COPYING.  If not see
+  <http://www.gnu.org/licenses/>.  */
+
+#include "util/buffer-pool.H"
+#include <new>
+#include <cstdint>
+#include <cassert>
+#include <algorithm>
+
+using std::size_t;
+using std::unique_lock;
+using std::mutex;
+
+// Sizes are measured in units of the alignment.  The size classes are 1,2,3,4, and then
+// 5,6,7,8 times successive powers of 2: that is, 4 classes per doubling.
+static int size_class(size_t units)
+{
+    assert(units > 0);
+    if (units <= 4) return units - 1;
+
+    // Find e such that 4*2^e < units <= 8*2^e.
+    int e = 0;
+    while ((size_t(8) << e) < units)
+	e++;
+
+    // Find j in {1..4} such that (4+j-1)*2^e < units <= (4+j)*2^e.
+    size_t step = size_t(1) << e;
+    int j = (units - 4*step + step - 1) / step;
+    assert(1 <= j and j <= 4);
+
+    return 4*(e+1) + (j-1);
+}
+
+static size_t size_class_units(int cls)
+{
+    if (cls < 4) return cls + 1;
+
+    int e = cls/4 - 1;
+    int j = cls%4 + 1;
+    return size_t(4+j) << e;
+}
+
+static size_t units_for_bytes(size_t bytes)
+{
+    return (bytes + buffer_pool::buffer_alignment - 1)/buffer_pool::buffer_alignment;
+}
+
+// We over-allocate and keep the pointer that we got from operator new in the word just
+// before the aligned buffer.  Pointers from operator new are at least word-aligned, so
+// there is always room for it.
+static void* allocate_aligned(size_t bytes)
+{
+    constexpr size_t A = buffer_pool::buffer_alignment;
+    char* raw = static_cast<char*>(::operator new(bytes + A));
+    char* aligned = reinterpret_cast<char*>((reinterpret_cast<std::uintptr_t>(raw) + A) & ~std::uintptr_t(A-1));
+    reinterpret_cast<void**>(aligned)[-1] = raw;
+    return aligned;
+}
+
+static void free_aligned(void* buffer)
+{
+    ::operator delete(reinterpret_cast<void**>(buffer)[-1]);
+}
+
+void* buffer_pool::allocate(size_t bytes)
+{
+    if (bytes == 0) bytes = 1;
+    int cls = size_class(units_for_bytes(bytes));
+    size_t class_bytes = size_class_units(cls) * buffer_alignment;
+
+    {
+	unique_lock<mutex> lock(mutex_);
+
+	stats_.allocations++;
+	stats_.bytes_in_use += class_bytes;
+	stats_.peak_bytes_in_use = std::max(stats_.peak_bytes_in_use, stats_.bytes_in_use);
+
+	if (cls < free_lists.size() and not free_lists[cls].empty())
+	{
+	    void* buffer = free_lists[cls].back();
+	    free_lists[cls].pop_back();
+	    stats_.hits++;
+	    stats_.bytes_free -= class_bytes;
+	    return buffer;
+	}
+    }
+
+    return allocate_aligned(class_bytes);
+}
+
+void buffer_pool::release(void* buffer, size_t bytes)
+{
+    if (not buffer) return;
+
+    if (bytes == 0) bytes = 1;
+    int cls = size_class(units_for_bytes(bytes));
+    size_t class_bytes = size_class_units(cls) * buffer_alignment;
+
+    unique_lock<mutex> lock(mutex_);
+
+    assert(stats_.bytes_in_use >= class_bytes);
+    stats_.bytes_in_use -= class_bytes;
+    stats_.bytes_free += class_bytes;
+
+    if (cls >= free_lists.size())
+	free_lists.resize(cls+1);
+    free_lists[cls].push_back(buffer);
+}
+
+void buffer_pool::clear()
+{
+    unique_lock<mutex> lock(mutex_);
+
+    for(auto& free_list: free_lists)
+    {
+	for(void* buffer: free_list)
+	    free_aligned(buffer);
+	free_list.clear();
+    }
+    stats_.bytes_free = 0;
+}
+
+buffer_pool_stats buffer_pool::stats() const
+{
+    unique_lock<mutex> lock(mutex_);
+    return stats_;
+}
+
+buffer_pool::~buffer_pool()
+{
+    clear();
+}
+
+std::ostream& operator<<(std::ostream& o, const buffer_pool_stats& stats)
+{
+    o<<stats.allocations<<" allocations, "<<int(stats.hit_rate()*100.0+0.5)<<"% reused, ";
+    o<<"peak "<<stats.peak_bytes_in_use/(1024*1024)<<" MB in use";
+    return o;
+}
+
+buffer_pool& likelihood_buffer_pool()
+{
+    // Never destroyed, so that cache branches that outlive main( ) can still release their storage.
+    static buffer_pool* pool = new buffer_pool;
+    return *pool;
+}
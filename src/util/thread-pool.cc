@@ -0,0 +1,261 @@
+/*
+  Copyright (C) 2018 Benjamin Redelings
+
+  This file is part of BAli-Phy.
+
+  BAli-Phy is free software; you can redistribute it and/or modify it under
+  the terms of the GNU General Public License as published by the Free
+  Software Foundation; either version 2, or (at your option) any later
+  version.
+
+  BAli-Phy is distributed in the hope that it will be useful, but WITHOUT ANY
+  WARRANTY; without even the implied warranty of MERCHANTABILITY or
+  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+  for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with BAli-Phy; see the file COPYING.  If not see
+  <http://www.gnu.org/licenses/>.  */
+
+#include "util/thread-pool.H"
+#include <memory>
+#include <atomic>
+#include <algorithm>
+#include <cassert>
+#include <exception>
+
+using std::unique_lock;
+using std::mutex;
+
+//--------------------------------- pending_result -------------------------------//
+
+bool pending_result::ready() const
+{
+    unique_lock<mutex> lock(mutex_);
+    return ready_;
+}
+
+void pending_result::start()
+{
+    unique_lock<mutex> lock(mutex_);
+    assert(ready_);
+    ready_ = false;
+}
+
+void pending_result::finish()
+{
+    unique_lock<mutex> lock(mutex_);
+    ready_ = true;
+    changed.notify_all();
+}
+
+void pending_result::wait() const
+{
+    unique_lock<mutex> lock(mutex_);
+    changed.wait(lock, [this]{return ready_;});
+}
+
+void pending_result::add_reader()
+{
+    unique_lock<mutex> lock(mutex_);
+    readers_++;
+}
+
+void pending_result::remove_reader()
+{
+    unique_lock<mutex> lock(mutex_);
+    assert(readers_ > 0);
+    readers_--;
+    if (readers_ == 0)
+	changed.notify_all();
+}
+
+void pending_result::wait_idle() const
+{
+    unique_lock<mutex> lock(mutex_);
+    changed.wait(lock, [this]{return ready_ and readers_ == 0;});
+}
+
+//---------------------------------- thread_pool ---------------------------------//
+
+// Are we inside a task that was submitted to a thread_pool?
+static thread_local bool in_task = false;
+
+bool thread_pool::run_one_task()
+{
+    std::function<void()> task;
+    {
+	unique_lock<mutex> lock(mutex_);
+	if (tasks.empty()) return false;
+	task = std::move(tasks.front());
+	tasks.pop_front();
+    }
+
+    bool was_in_task = in_task;
+    in_task = true;
+    task();
+    in_task = was_in_task;
+    return true;
+}
+
+void thread_pool::worker_loop()
+{
+    in_task = true;
+    while(true)
+    {
+	std::function<void()> task;
+	{
+	    unique_lock<mutex> lock(mutex_);
+	    task_available.wait(lock, [this]{return stopping or not tasks.empty();});
+	    if (tasks.empty()) return;
+	    task = std::move(tasks.front());
+	    tasks.pop_front();
+	}
+	task();
+    }
+}
+
+void thread_pool::submit(std::function<void()> task)
+{
+    if (workers.empty())
+    {
+	task();
+	return;
+    }
+
+    {
+	unique_lock<mutex> lock(mutex_);
+	tasks.push_back(std::move(task));
+    }
+    task_available.notify_one();
+}
+
+// A task may only wait for tasks that were submitted before it.  If a thread that is
+// running a task were to run other queued tasks while it waits, then one of those
+// later tasks might wait on the suspended task, and we would deadlock.  Therefore
+// only threads that are not running a task help out.
+void thread_pool::wait(const pending_result& R)
+{
+    if (not in_task)
+	while (not R.ready() and run_one_task())
+	    ;
+    R.wait();
+}
+
+namespace
+{
+    struct parallel_for_state
+    {
+	const int n;
+	const std::function<void(int)>* body;
+	std::atomic<int> next{0};
+
+	std::mutex mutex_;
+	std::condition_variable all_done;
+	int n_done = 0;
+
+	/// The first exception thrown by body( ).
+	std::exception_ptr error;
+
+	// Claim and run calls to body( ) until there are none left.
+	void run()
+	{
+	    int i;
+	    while((i = next++) < n)
+	    {
+		std::exception_ptr e;
+		try
+		{
+		    (*body)(i);
+		}
+		catch (...)
+		{
+		    e = std::current_exception();
+		}
+
+		unique_lock<mutex> lock(mutex_);
+		if (e and not error)
+		    error = e;
+		n_done++;
+		if (n_done == n)
+		    all_done.notify_all();
+	    }
+	}
+
+	parallel_for_state(int i, const std::function<void(int)>* f):n(i),body(f) {}
+    };
+}
+
+// Helper tasks may not start until after we return, so they share the state through a
+// shared_ptr.  A helper that starts after every index has been claimed does nothing.
+void thread_pool::parallel_for(int n, const std::function<void(int)>& body)
+{
+    if (n <= 0) return;
+
+    if (workers.empty() or n == 1)
+    {
+	for(int i=0;i<n;i++)
+	    body(i);
+	return;
+    }
+
+    auto state = std::make_shared<parallel_for_state>(n, &body);
+
+    int n_helpers = std::min<int>(n-1, workers.size());
+    for(int i=0;i<n_helpers;i++)
+	submit([state]{state->run();});
+
+    state->run();
+
+    unique_lock<mutex> lock(state->mutex_);
+    state->all_done.wait(lock, [&]{return state->n_done == n;});
+
+    if (state->error)
+	std::rethrow_exception(state->error);
+}
+
+thread_pool::thread_pool(int n)
+{
+    for(int i=0;i<n;i++)
+	workers.emplace_back([this]{worker_loop();});
+}
+
+thread_pool::~thread_pool()
+{
+    {
+	unique_lock<mutex> lock(mutex_);
+	stopping = true;
+    }
+    task_available.notify_all();
+    for(auto& worker: workers)
+	worker.join();
+}
+
+//--------------------------------- shared pool ---------------------------------//
+
+static int n_threads_ = 1;
+
+static std::unique_ptr<thread_pool> shared_pool;
+
+// Several chains may ask for the pool at the same time.
+static mutex shared_pool_mutex;
+
+thread_pool& worker_pool()
+{
+    unique_lock<mutex> lock(shared_pool_mutex);
+    if (not shared_pool)
+	shared_pool.reset(new thread_pool(n_threads_ - 1));
+    return *shared_pool;
+}
+
+void set_n_threads(int n)
+{
+    assert(n >= 1);
+    n_threads_ = n;
+    shared_pool.reset();
+}
+
+int n_threads()
+{
+    return n_threads_;
+}
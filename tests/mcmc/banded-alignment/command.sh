@@ -0,0 +1,6 @@
+# A narrow band should be widened until it holds the paths, so the banded moves should be accepted.
+"$@" "$DATA/5d.fasta" --iter=5 --seed=1 --set alignment_band_width=1 --name=ignore-output-banded
+grep -q "sample_alignment_banded:" ignore-output-banded-1/C1.out
+! grep -q "All paths have probability 0" ignore-output-banded-1/C1.err || exit 1
+# A negative width is an error.
+! "$@" "$DATA/5d.fasta" --iter=1 --set alignment_band_width=-1 --name=ignore-output-negative || exit 1
@@ -0,0 +1,11 @@
+# Heated chains in threads should write a log for each chain, and repeating the run should give the same samples.
+"$@" "$DATA/5d.fasta" --iter=5 --seed=1 --chains=2 --beta=1,0.5 --name=ignore-output-a
+"$@" "$DATA/5d.fasta" --iter=5 --seed=1 --chains=2 --beta=1,0.5 --name=ignore-output-b
+for f in C1.log C2.log C1.trees C2.trees; do
+    cmp ignore-output-a-1/$f ignore-output-b-1/$f
+done
+head -n 1 ignore-output-a-1/C2.log | grep -q beta
+# Swapping less often still writes every chain.
+"$@" "$DATA/5d.fasta" --iter=5 --seed=1 --chains=2 --beta=1,0.5 --swap-interval=2 --name=ignore-output-swap
+test -s ignore-output-swap-1/C2.log
+! "$@" "$DATA/5d.fasta" --iter=5 --chains=2 --beta=1,0.5 --swap-interval=0 --name=ignore-output-bad || exit 1
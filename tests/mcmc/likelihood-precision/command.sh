@@ -0,0 +1,15 @@
+# --likelihood-precision=check uses the double-precision results, so it should write the same samples as the default.
+"$@" "$DATA/5d.fasta" --iter=5 --seed=1 --name=ignore-output-double
+"$@" "$DATA/5d.fasta" --iter=5 --seed=1 --likelihood-precision=check --name=ignore-output-check
+"$@" "$DATA/5d.fasta" --iter=5 --seed=1 --likelihood-precision=single --name=ignore-output-single
+cmp ignore-output-double-1/C1.log ignore-output-check-1/C1.log
+cmp ignore-output-double-1/C1.trees ignore-output-check-1/C1.trees
+
+# The single-precision log-likelihoods should be within 0.001 of the double-precision ones.
+# On 12d, some columns have values too small for single precision unless they are rescaled to [1/2,1).
+"$@" "$DATA/12d.fasta" --iter=10 --seed=3 --likelihood-precision=check --name=ignore-output-check12
+for run in check check12; do
+    error=$(sed -n 's/^single precision: max log-likelihood error = \([^ ]*\) .*/\1/p' ignore-output-$run-1/C1.out)
+    test -n "$error"
+    awk -v error="$error" 'BEGIN {exit !(error+0 < 0.001)}'
+done
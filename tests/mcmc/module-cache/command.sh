@@ -0,0 +1,13 @@
+# Modules loaded from a warm cache should give the same run as modules compiled from source.
+"$@" "$DATA/5d.fasta" --iter=5 --seed=1 --name=ignore-output-none
+"$@" "$DATA/5d.fasta" --iter=5 --seed=1 --module-cache=ignore-output-cache --name=ignore-output-cold
+test -n "$(ls ignore-output-cache)"
+touch ignore-output-marker
+"$@" "$DATA/5d.fasta" --iter=5 --seed=1 --module-cache=ignore-output-cache --name=ignore-output-warm
+# The warm run should not have compiled and saved any module again.
+test -z "$(find ignore-output-cache -newer ignore-output-marker)"
+for run in cold warm; do
+    cmp ignore-output-none-1/C1.log ignore-output-$run-1/C1.log
+    cmp ignore-output-none-1/C1.trees ignore-output-$run-1/C1.trees
+    cmp ignore-output-none-1/C1.P1.fastas ignore-output-$run-1/C1.P1.fastas
+done
@@ -0,0 +1,12 @@
+# A run that is stopped and then resumed from its checkpoint should write the same samples as a run that is not stopped.
+# Options in ~/.bali-phy should not prevent resuming.
+mkdir ignore-output-home
+echo "pre-burnin = 2" > ignore-output-home/.bali-phy
+export HOME="$PWD/ignore-output-home"
+"$@" "$DATA/5d.fasta" --iter=10 --seed=1 --checkpoint=5 --name=ignore-output-full
+"$@" "$DATA/5d.fasta" --iter=8 --seed=1 --checkpoint=5 --name=ignore-output-resumed
+"$@" --resume=ignore-output-resumed-1 --iter=10
+cmp ignore-output-full-1/C1.trees ignore-output-resumed-1/C1.trees
+cmp ignore-output-full-1/C1.P1.fastas ignore-output-resumed-1/C1.P1.fastas
+# The .log files can differ in the last digits of the prior, so we only compare their lengths.
+test $(wc -l < ignore-output-full-1/C1.log) = $(wc -l < ignore-output-resumed-1/C1.log)
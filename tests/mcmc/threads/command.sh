@@ -0,0 +1,6 @@
+# Runs with one and with two threads should write the same samples.
+"$@" "$DATA/5d.fasta" "$DATA/5d-muscle.fasta" --iter=5 --seed=1 --threads=1 --name=ignore-output-j1
+"$@" "$DATA/5d.fasta" "$DATA/5d-muscle.fasta" --iter=5 --seed=1 --threads=2 --name=ignore-output-j2
+cmp ignore-output-j1-1/C1.log ignore-output-j2-1/C1.log
+cmp ignore-output-j1-1/C1.trees ignore-output-j2-1/C1.trees
+cmp ignore-output-j1-1/C1.P1.fastas ignore-output-j2-1/C1.P1.fastas
@@ -2,6 +2,8 @@
 from __future__ import print_function
 import subprocess
 import os
+import glob
+import shutil
 
 NUM_TESTS = 0
 FAILED_TESTS = []
@@ -60,6 +62,9 @@ class RevBayes:
     def control_file(self):
         return "rb-command.Rev"
 
+    def script_file(self):
+        return None
+
     def cmdline(self, tester, test_subdir):
         import re
         return cmd
@@ -90,9 +95,17 @@ class BAliPhy:
     def control_file(self):
         return "command.txt"
 
+    def script_file(self):
+        return "command.sh"
+
     def cmdline(self, tester, test_subdir):
         import re
         test_dir = tester.dir_for_test(test_subdir)
+        script_filename = os.path.join(test_dir,self.script_file())
+        if os.path.exists(script_filename):
+            # Scripts stop at the first failing command, and find the data directory in $DATA.
+            # Since sh -e ignores commands negated with !, scripts add || exit 1 to them.
+            return ['sh', '-e', script_filename] + cmd
         args_filename = os.path.join(test_dir,self.control_file())
         args = open(args_filename,'r').read()
         args = re.sub('<DATA>',tester.data_dir,args)
@@ -117,6 +130,14 @@ class Tester:
         self.data_dir = data_dir
         self.method = method
 
+        # Let test scripts run the tools that were built along with the program.
+        self.env = dict(os.environ)
+        if os.path.isabs(method.cmd[0]):
+            bin_dir = os.path.dirname(method.cmd[0])
+            path = [bin_dir, os.path.join(bin_dir,'tools')]
+            self.env['PATH'] = os.pathsep.join(path + [self.env.get('PATH','')])
+        self.env['DATA'] = data_dir
+
     def dir_for_test(self, test_subdir):
         return os.path.join(self.top_test_dir, test_subdir)
 
@@ -125,8 +146,9 @@ class Tester:
 
     def get_test_dirs(self):
         test_dirs = []
+        script_file = self.method.script_file()
         for root, dirs, files in os.walk(top_test_dir):
-            if self.method.control_file() in files:
+            if self.method.control_file() in files or script_file in files:
                 path = os.path.relpath(root, top_test_dir)
                 test_dirs.insert(0,path)
         return test_dirs
@@ -142,11 +164,18 @@ class Tester:
         cmd = self.method.cmdline(self, test_subdir)
         stdin = self.method.stdin(self, test_subdir)
 
+        # Remove the files that a script wrote the last time that it ran.
+        for f in glob.glob(os.path.join(rundir, 'ignore-output-*')):
+            if os.path.isdir(f):
+                shutil.rmtree(f)
+            else:
+                os.remove(f)
+
         with codecs.open(obt_outf, 'w', encoding='utf-8') as obt_out:
             with codecs.open(obt_errf, 'w', encoding='utf-8') as obt_err:
     #            invocation = '"{}"'.format('" "'.join(cmd))
     #            debug('Running: ' + invocation + ' >"' + obt_outf + '" 2>"' + obt_errf + '" ; echo $? >"' + obt_exitf + '"')
-                p = subprocess.Popen(cmd, cwd=rundir, stdin=subprocess.PIPE, stdout=obt_out, stderr=obt_err)
+                p = subprocess.Popen(cmd, cwd=rundir, env=self.env, stdin=subprocess.PIPE, stdout=obt_out, stderr=obt_err)
                 p.communicate(input=stdin)
                 exit_code = p.wait()
                 with codecs.open(obt_exitf, 'w', encoding='utf-8') as obt_exit:
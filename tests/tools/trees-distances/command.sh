@@ -0,0 +1,12 @@
+# The distance matrix should not depend on --stream or on the number of threads.
+"$@" "$DATA/5d.fasta" --iter=20 --seed=1 --name=ignore-output-trees
+trees=ignore-output-trees-1/C1.trees
+for metric in topology branch; do
+    trees-distances matrix --metric=$metric --threads=1 $trees > ignore-output-$metric-j1
+    trees-distances matrix --metric=$metric --threads=2 $trees > ignore-output-$metric-j2
+    trees-distances matrix --metric=$metric --threads=2 --stream $trees > ignore-output-$metric-stream
+    cmp ignore-output-$metric-j1 ignore-output-$metric-j2
+    cmp ignore-output-$metric-j1 ignore-output-$metric-stream
+done
+# --remove-duplicates needs the whole matrix.
+! trees-distances matrix --stream --remove-duplicates $trees || exit 1